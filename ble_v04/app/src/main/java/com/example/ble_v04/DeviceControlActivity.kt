@@ -1,16 +1,25 @@
 package com.example.ble_v04
 
 import android.Manifest
+import android.annotation.SuppressLint
 import android.bluetooth.*
+import android.content.BroadcastReceiver
+import android.content.Context
+import android.content.Intent
+import android.content.IntentFilter
 import android.content.pm.PackageManager
 import android.os.Build
 import android.os.Bundle
+import android.os.SystemClock
 import androidx.activity.ComponentActivity
 import androidx.activity.compose.setContent
 import androidx.activity.result.ActivityResultLauncher
 import androidx.activity.result.contract.ActivityResultContracts
 import androidx.compose.runtime.mutableStateOf
 import androidx.core.content.ContextCompat
+import java.util.Calendar
+import java.util.Date
+import java.util.TimeZone
 import java.util.UUID
 
 class DeviceControlActivity : ComponentActivity() {
@@ -22,9 +31,43 @@ class DeviceControlActivity : ComponentActivity() {
     private lateinit var permissionLauncher: ActivityResultLauncher<Array<String>>
     private var deviceToConnect: BluetoothDevice? = null
 
+    // Current Time Service exchange: read the watch's time to time a round
+    // trip, write Local Time Information, then write Current Time moved
+    // forward by half the fastest round trip seen.
+    private var requestStartedAt = 0L
+    private var roundTripMs = Long.MAX_VALUE
+    private var watchError = ""
+    private var syncResult = ""
+
+    // The watch only takes the time from a bonded phone. Bonding runs over
+    // the open connection; the time sync starts once it is done.
+    private val bondReceiver = object : BroadcastReceiver() {
+        override fun onReceive(context: Context, intent: Intent) {
+            val gatt = bluetoothGatt ?: return
+            @Suppress("DEPRECATION")
+            val device = intent.getParcelableExtra<BluetoothDevice>(BluetoothDevice.EXTRA_DEVICE)
+            if (device?.address != gatt.device.address) return
+            val state = intent.getIntExtra(BluetoothDevice.EXTRA_BOND_STATE, BluetoothDevice.BOND_NONE)
+            val previous = intent.getIntExtra(BluetoothDevice.EXTRA_PREVIOUS_BOND_STATE, BluetoothDevice.BOND_NONE)
+            if (state == BluetoothDevice.BOND_BONDED) {
+                if (!startTimeSync(gatt)) enableBatteryNotifications(gatt)
+            } else if (state == BluetoothDevice.BOND_NONE && previous == BluetoothDevice.BOND_BONDING) {
+                connectionState.value = "Koppelen mislukt"
+                enableBatteryNotifications(gatt)
+            }
+        }
+    }
+
     override fun onCreate(savedInstanceState: Bundle?) {
         super.onCreate(savedInstanceState)
 
+        ContextCompat.registerReceiver(
+            this,
+            bondReceiver,
+            IntentFilter(BluetoothDevice.ACTION_BOND_STATE_CHANGED),
+            ContextCompat.RECEIVER_EXPORTED
+        )
+
         permissionLauncher = registerForActivityResult(
             ActivityResultContracts.RequestMultiplePermissions()
         ) { permissions ->
@@ -85,6 +128,146 @@ class DeviceControlActivity : ComponentActivity() {
         bluetoothGatt = device.connectGatt(this, false, gattCallback)
     }
 
+    private fun hasConnectPermission(): Boolean =
+        Build.VERSION.SDK_INT < Build.VERSION_CODES.S ||
+            ContextCompat.checkSelfPermission(this, Manifest.permission.BLUETOOTH_CONNECT) == PackageManager.PERMISSION_GRANTED
+
+    @SuppressLint("MissingPermission")
+    private fun startTimeSync(gatt: BluetoothGatt): Boolean {
+        val characteristic = gatt.getService(CURRENT_TIME_SERVICE_UUID)
+            ?.getCharacteristic(CURRENT_TIME_UUID) ?: return false
+        if (!hasConnectPermission()) return false
+
+        // a short connection interval keeps the round trips short and steady
+        gatt.requestConnectionPriority(BluetoothGatt.CONNECTION_PRIORITY_HIGH)
+        roundTripMs = Long.MAX_VALUE
+        watchError = ""
+        syncResult = ""
+        connectionState.value = "Tijd synchroniseren..."
+        requestStartedAt = SystemClock.elapsedRealtime()
+        return gatt.readCharacteristic(characteristic)
+    }
+
+    private fun onWatchTimeRead(gatt: BluetoothGatt, characteristic: BluetoothGattCharacteristic, status: Int) {
+        val now = System.currentTimeMillis()
+        roundTripMs = minOf(roundTripMs, SystemClock.elapsedRealtime() - requestStartedAt)
+        @Suppress("DEPRECATION")
+        val value = characteristic.value
+        val watchMs = if (status == BluetoothGatt.GATT_SUCCESS && value != null) parseCurrentTime(value) else null
+        if (watchMs != null) {
+            // the watch read its clock about half way through the round trip
+            watchError = ", afwijking was %+.3f s".format((watchMs - (now - roundTripMs / 2)) / 1000.0)
+        }
+
+        val info = characteristic.service.getCharacteristic(LOCAL_TIME_INFO_UUID)
+        if (info == null || !writeCharacteristic(gatt, info, localTimeInfoValue(System.currentTimeMillis()))) {
+            writeCurrentTime(gatt, characteristic)
+        }
+    }
+
+    private fun writeCurrentTime(gatt: BluetoothGatt, characteristic: BluetoothGattCharacteristic?) {
+        if (characteristic == null) {
+            enableBatteryNotifications(gatt)
+            return
+        }
+        // the watch sets its clock when the write arrives, half a round trip from now
+        val value = currentTimeValue(System.currentTimeMillis() + roundTripMs / 2)
+        if (!writeCharacteristic(gatt, characteristic, value)) {
+            connectionState.value = "Tijd schrijven mislukt"
+            enableBatteryNotifications(gatt)
+        }
+    }
+
+    @SuppressLint("MissingPermission")
+    @Suppress("DEPRECATION")
+    private fun writeCharacteristic(
+        gatt: BluetoothGatt,
+        characteristic: BluetoothGattCharacteristic,
+        value: ByteArray
+    ): Boolean {
+        if (!hasConnectPermission()) return false
+        characteristic.writeType = BluetoothGattCharacteristic.WRITE_TYPE_DEFAULT
+        characteristic.value = value
+        requestStartedAt = SystemClock.elapsedRealtime()
+        return gatt.writeCharacteristic(characteristic)
+    }
+
+    // Current Time (0x2A2B): local year, month, day, hours, minutes, seconds,
+    // day of week with Monday 1, 1/256 s and the adjust reason.
+    private fun currentTimeValue(millis: Long): ByteArray {
+        val c = Calendar.getInstance().apply { timeInMillis = millis }
+        val year = c.get(Calendar.YEAR)
+        return byteArrayOf(
+            year.toByte(),
+            (year shr 8).toByte(),
+            (c.get(Calendar.MONTH) + 1).toByte(),
+            c.get(Calendar.DAY_OF_MONTH).toByte(),
+            c.get(Calendar.HOUR_OF_DAY).toByte(),
+            c.get(Calendar.MINUTE).toByte(),
+            c.get(Calendar.SECOND).toByte(),
+            ((c.get(Calendar.DAY_OF_WEEK) + 5) % 7 + 1).toByte(),
+            (c.get(Calendar.MILLISECOND) * 256 / 1000).toByte(),
+            ADJUST_EXTERNAL_REFERENCE
+        )
+    }
+
+    private fun parseCurrentTime(value: ByteArray): Long? {
+        if (value.size < 9) return null
+        val b = value.map { it.toInt() and 0xFF }
+        return Calendar.getInstance().apply {
+            clear()
+            set(b[0] or (b[1] shl 8), b[2] - 1, b[3], b[4], b[5], b[6])
+            set(Calendar.MILLISECOND, b[8] * 1000 / 256)
+        }.timeInMillis
+    }
+
+    // Local Time Information (0x2A0F): standard offset and DST offset, both
+    // in quarter hours.
+    private fun localTimeInfoValue(millis: Long): ByteArray {
+        val zone = TimeZone.getDefault()
+        val dst = if (zone.inDaylightTime(Date(millis))) zone.dstSavings else 0
+        return byteArrayOf(
+            ((zone.getOffset(millis) - dst) / QUARTER_HOUR_MS).toByte(),
+            (dst / QUARTER_HOUR_MS).toByte()
+        )
+    }
+
+    @SuppressLint("MissingPermission")
+    private fun enableBatteryNotifications(gatt: BluetoothGatt) {
+        val batteryServiceUUID = UUID.fromString("0000180F-0000-1000-8000-00805f9b34fb")
+        val batteryLevelUUID = UUID.fromString("00002A19-0000-1000-8000-00805f9b34fb")
+        val cccdUUID = UUID.fromString("00002902-0000-1000-8000-00805f9b34fb")
+
+        val service = gatt.getService(batteryServiceUUID)
+        val characteristic = service?.getCharacteristic(batteryLevelUUID)
+
+        if (characteristic != null) {
+            if (!hasConnectPermission()) {
+                connectionState.value = "BLUETOOTH_CONNECT permission missing"
+                return
+            }
+
+            val success = gatt.setCharacteristicNotification(characteristic, true)
+            if (!success) {
+                connectionState.value = "Notificatie-instelling mislukt"
+                return
+            }
+
+            val descriptor = characteristic.getDescriptor(cccdUUID)
+            if (descriptor != null) {
+                @Suppress("DEPRECATION")
+                descriptor.value = BluetoothGattDescriptor.ENABLE_NOTIFICATION_VALUE
+                @Suppress("DEPRECATION")
+                val result = gatt.writeDescriptor(descriptor)
+                connectionState.value = if (result) "Notificaties ingeschakeld" else "Descriptor schrijven mislukt"
+            } else {
+                connectionState.value = "CCCD niet gevonden"
+            }
+        } else if (gatt.getService(CURRENT_TIME_SERVICE_UUID) == null) {
+            connectionState.value = "Battery characteristic niet gevonden"
+        }
+    }
+
     private val gattCallback = object : BluetoothGattCallback() {
 
         override fun onConnectionStateChange(gatt: BluetoothGatt?, status: Int, newState: Int) {
@@ -101,50 +284,51 @@ class DeviceControlActivity : ComponentActivity() {
                 bluetoothGatt?.discoverServices()
 
             } else if (newState == BluetoothProfile.STATE_DISCONNECTED) {
-                connectionState.value = "Disconnected"
+                // the watch hangs up once it has the time
+                connectionState.value = if (syncResult.isEmpty()) "Disconnected" else "$syncResult, disconnected"
                 bluetoothGatt?.close()
                 bluetoothGatt = null
             }
         }
 
+        @SuppressLint("MissingPermission")
         override fun onServicesDiscovered(gatt: BluetoothGatt?, status: Int) {
             if (status != BluetoothGatt.GATT_SUCCESS || gatt == null) {
                 connectionState.value = "Service discovery failed"
                 return
             }
 
-            val batteryServiceUUID = UUID.fromString("0000180F-0000-1000-8000-00805f9b34fb")
-            val batteryLevelUUID = UUID.fromString("00002A19-0000-1000-8000-00805f9b34fb")
-            val cccdUUID = UUID.fromString("00002902-0000-1000-8000-00805f9b34fb")
-
-            val service = gatt.getService(batteryServiceUUID)
-            val characteristic = service?.getCharacteristic(batteryLevelUUID)
-
-            if (characteristic != null) {
-                if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.S) {
-                    if (ContextCompat.checkSelfPermission(this@DeviceControlActivity, Manifest.permission.BLUETOOTH_CONNECT)
-                        != PackageManager.PERMISSION_GRANTED) {
-                        connectionState.value = "BLUETOOTH_CONNECT permission missing"
-                        return
-                    }
-                }
+            if (gatt.getService(CURRENT_TIME_SERVICE_UUID) != null && hasConnectPermission() &&
+                gatt.device.bondState != BluetoothDevice.BOND_BONDED) {
+                connectionState.value = "Koppelen met horloge..."
+                if (gatt.device.createBond()) return
+            }
+            if (!startTimeSync(gatt)) {
+                enableBatteryNotifications(gatt)
+            }
+        }
 
-                val success = bluetoothGatt?.setCharacteristicNotification(characteristic, true) ?: false
-                if (!success) {
-                    connectionState.value = "Notificatie-instelling mislukt"
-                    return
+        @SuppressLint("MissingPermission")
+        override fun onCharacteristicWrite(
+            gatt: BluetoothGatt?,
+            characteristic: BluetoothGattCharacteristic?,
+            status: Int
+        ) {
+            if (gatt == null || characteristic == null || !hasConnectPermission()) return
+            if (characteristic.uuid == LOCAL_TIME_INFO_UUID) {
+                // without it the watch converts with its own zone
+                if (status == BluetoothGatt.GATT_SUCCESS) {
+                    roundTripMs = minOf(roundTripMs, SystemClock.elapsedRealtime() - requestStartedAt)
                 }
-
-                val descriptor = characteristic.getDescriptor(cccdUUID)
-                if (descriptor != null) {
-                    descriptor.value = BluetoothGattDescriptor.ENABLE_NOTIFICATION_VALUE
-                    val result = bluetoothGatt?.writeDescriptor(descriptor)
-                    connectionState.value = if (result == true) "Notificaties ingeschakeld" else "Descriptor schrijven mislukt"
+                writeCurrentTime(gatt, characteristic.service.getCharacteristic(CURRENT_TIME_UUID))
+            } else if (characteristic.uuid == CURRENT_TIME_UUID) {
+                if (status == BluetoothGatt.GATT_SUCCESS) {
+                    syncResult = "Tijd gesynchroniseerd$watchError (round trip $roundTripMs ms)"
+                    connectionState.value = syncResult
                 } else {
-                    connectionState.value = "CCCD niet gevonden"
+                    connectionState.value = "Tijd instellen mislukt ($status)"
                 }
-            } else {
-                connectionState.value = "Battery characteristic niet gevonden"
+                enableBatteryNotifications(gatt)
             }
         }
 
@@ -154,6 +338,10 @@ class DeviceControlActivity : ComponentActivity() {
             characteristic: BluetoothGattCharacteristic?,
             status: Int
         ) {
+            if (characteristic != null && characteristic.uuid == CURRENT_TIME_UUID) {
+                if (gatt != null) onWatchTimeRead(gatt, characteristic, status)
+                return
+            }
             if (status == BluetoothGatt.GATT_SUCCESS && characteristic != null) {
                 val value = characteristic.value
                 if (value != null && value.isNotEmpty()) {
@@ -184,6 +372,7 @@ class DeviceControlActivity : ComponentActivity() {
 
     override fun onDestroy() {
         super.onDestroy()
+        unregisterReceiver(bondReceiver)
         if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.S) {
             if (ContextCompat.checkSelfPermission(this, Manifest.permission.BLUETOOTH_CONNECT)
                 != PackageManager.PERMISSION_GRANTED) {
@@ -193,6 +382,14 @@ class DeviceControlActivity : ComponentActivity() {
         bluetoothGatt?.close()
         bluetoothGatt = null
     }
+
+    companion object {
+        private val CURRENT_TIME_SERVICE_UUID = UUID.fromString("00001805-0000-1000-8000-00805f9b34fb")
+        private val CURRENT_TIME_UUID = UUID.fromString("00002A2B-0000-1000-8000-00805f9b34fb")
+        private val LOCAL_TIME_INFO_UUID = UUID.fromString("00002A0F-0000-1000-8000-00805f9b34fb")
+        private const val ADJUST_EXTERNAL_REFERENCE: Byte = 0x02
+        private const val QUARTER_HOUR_MS = 15 * 60 * 1000
+    }
 }
 
 
@@ -0,0 +1,330 @@
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <sys/time.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "civil.h"
+#include "ds3231.h"
+#include "ble_cts.h"
+
+#if CONFIG_BT_NIMBLE_ENABLED
+#include "nimble/nimble_port.h"
+#include "nimble/nimble_port_freertos.h"
+#include "host/ble_hs.h"
+#include "host/util/util.h"
+#include "services/gap/ble_svc_gap.h"
+#include "services/gatt/ble_svc_gatt.h"
+
+#define TAG "BLE_CTS"
+#define CTS_SERVICE_UUID 0x1805
+#define CTS_CURRENT_TIME_UUID 0x2A2B
+#define CTS_LOCAL_INFO_UUID 0x2A0F
+#define CTS_CURRENT_TIME_LEN 10
+#define CTS_LOCAL_INFO_LEN 2
+#define CTS_ZONE_UNKNOWN (-128)
+#define CTS_DST_UNKNOWN 255
+#define CTS_ERR_DATA_FIELD_IGNORED 0x80	// CTS application error
+#define BLE_CTS_HANGUP_MS 250			// lets the write response out before disconnecting
+
+// NimBLE's NVS bond store, no header of its own
+void ble_store_config_init(void);
+
+#define TIME_SET BIT0
+#define DISCONNECTED BIT1
+
+// Shared with the NimBLE host task, which runs the callbacks.
+static struct {
+	tz_t *tz;
+	bool allow_pairing;
+	int64_t max_adjust_us;
+	EventGroupHandle_t events;
+	uint8_t own_addr_type;
+	volatile uint16_t conn;
+	volatile bool stopping;
+	bool local_info;		// the phone's offset for this connection
+	int32_t local_offset;
+	int64_t set_at;
+	int64_t adjust_us;
+} ctx;
+
+static int gap_event(struct ble_gap_event *event, void *arg);
+static int cts_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+
+static const struct ble_gatt_svc_def services[] = {
+	{
+		.type = BLE_GATT_SVC_TYPE_PRIMARY,
+		.uuid = BLE_UUID16_DECLARE(CTS_SERVICE_UUID),
+		.characteristics = (struct ble_gatt_chr_def[]) {
+			{
+				.uuid = BLE_UUID16_DECLARE(CTS_CURRENT_TIME_UUID),
+				.access_cb = cts_access,
+				.flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_ENC | BLE_GATT_CHR_F_NOTIFY,
+			},
+			{
+				.uuid = BLE_UUID16_DECLARE(CTS_LOCAL_INFO_UUID),
+				.access_cb = cts_access,
+				.flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_ENC,
+			},
+			{ 0 },
+		},
+	},
+	{ 0 },
+};
+
+// Exact Time 256 and an adjust reason: year (LE), month, day, hours, minutes,
+// seconds, day of week (1 = Monday), 1/256 s, reason. Local time.
+static uint16_t encode_current_time(uint8_t *buf)
+{
+	struct timeval tv;
+	struct tm t;
+	gettimeofday(&tv, NULL);
+	tz_localtime(ctx.tz, tv.tv_sec, &t);
+	uint16_t year = t.tm_year + 1900;
+	buf[0] = year;
+	buf[1] = year >> 8;
+	buf[2] = t.tm_mon + 1;
+	buf[3] = t.tm_mday;
+	buf[4] = t.tm_hour;
+	buf[5] = t.tm_min;
+	buf[6] = t.tm_sec;
+	buf[7] = t.tm_wday ? t.tm_wday : 7;
+	buf[8] = tv.tv_usec * 256 / 1000000;
+	buf[9] = 0;
+	return CTS_CURRENT_TIME_LEN;
+}
+
+// The phone's local time to UTC in microseconds, false for a time the RTC
+// cannot hold. The day of week and the adjust reason are not needed.
+static bool decode_current_time(const uint8_t *buf, int64_t *utc_us)
+{
+	uint16_t year = buf[0] | buf[1] << 8;
+	uint8_t month = buf[2], mday = buf[3], hour = buf[4], min = buf[5], sec = buf[6];
+	if (month < 1 || month > 12 || mday < 1 || mday > 31 || hour > 23 || min > 59 || sec > 59) return false;
+
+	time_t local = days_from_civil(year, month, mday) * 86400LL + hour * 3600 + min * 60 + sec;
+	time_t utc = ctx.local_info ? local - ctx.local_offset : tz_utc(ctx.tz, local);
+	if (utc < DS3231_EPOCH_MIN || utc > DS3231_EPOCH_MAX) return false;
+
+	// the phone truncates to 1/256 s, so take the middle of the step
+	*utc_us = utc * 1000000LL + (2 * buf[8] + 1) * 1000000LL / 512;
+	return true;
+}
+
+// Zone offset in 15 minute steps, then the DST offset in the same steps.
+static uint16_t encode_local_info(uint8_t *buf)
+{
+	int32_t offset = tz_offset(ctx.tz, time(NULL));
+	int32_t dst = ctx.tz->dst ? ctx.tz->zone->dst_offset - ctx.tz->zone->std_offset : 0;
+	buf[0] = (int8_t)((offset - dst) / (15 * 60));
+	buf[1] = dst / (15 * 60);
+	return CTS_LOCAL_INFO_LEN;
+}
+
+static bool decode_local_info(const uint8_t *buf)
+{
+	int8_t zone = buf[0];
+	uint8_t dst = buf[1];
+	if (zone == CTS_ZONE_UNKNOWN || dst == CTS_DST_UNKNOWN) {
+		ctx.local_info = false;
+		return true;
+	}
+	if (zone < -48 || zone > 56 || (dst != 0 && dst != 2 && dst != 4 && dst != 8)) return false;
+	ctx.local_offset = (zone + dst) * 15 * 60;
+	ctx.local_info = true;
+	return true;
+}
+
+static int cts_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+	int64_t arrival = esp_timer_get_time();
+	bool current_time = ble_uuid_u16(ctxt->chr->uuid) == CTS_CURRENT_TIME_UUID;
+	uint8_t buf[CTS_CURRENT_TIME_LEN];
+
+	if (ctxt->op == BLE_GATT_ACCESS_OP_READ_CHR) {
+		uint16_t len = current_time ? encode_current_time(buf) : encode_local_info(buf);
+		return os_mbuf_append(ctxt->om, buf, len) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+	}
+	if (ctxt->op != BLE_GATT_ACCESS_OP_WRITE_CHR) return BLE_ATT_ERR_UNLIKELY;
+
+	// the stack already wants the link encrypted; a phone that merely paired
+	// outside the pairing window is not bonded and gets nowhere
+	struct ble_gap_conn_desc desc;
+	if (ble_gap_conn_find(conn_handle, &desc) != 0 || !desc.sec_state.bonded) return BLE_ATT_ERR_INSUFFICIENT_AUTHEN;
+
+	uint16_t want = current_time ? CTS_CURRENT_TIME_LEN : CTS_LOCAL_INFO_LEN;
+	uint16_t len;
+	if (OS_MBUF_PKTLEN(ctxt->om) != want || ble_hs_mbuf_to_flat(ctxt->om, buf, want, &len) != 0) {
+		return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+	}
+	if (!current_time) return decode_local_info(buf) ? 0 : CTS_ERR_DATA_FIELD_IGNORED;
+
+	int64_t utc_us;
+	if (!decode_current_time(buf, &utc_us)) return CTS_ERR_DATA_FIELD_IGNORED;
+
+	// the phone's time was for the arrival
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	int64_t now = utc_us + (esp_timer_get_time() - arrival);
+	int64_t adjust_us = now - (tv.tv_sec * 1000000LL + tv.tv_usec);
+	if (ctx.max_adjust_us && llabs(adjust_us) > ctx.max_adjust_us) {
+		ESP_LOGW(TAG, "Ignoring a time %"PRId64" ms off", adjust_us / 1000);
+		return CTS_ERR_DATA_FIELD_IGNORED;
+	}
+	struct timeval set = { .tv_sec = now / 1000000, .tv_usec = now % 1000000 };
+	if (settimeofday(&set, NULL) != 0) return BLE_ATT_ERR_UNLIKELY;
+	ctx.adjust_us = adjust_us;
+	ctx.set_at = arrival;
+	xEventGroupSetBits(ctx.events, TIME_SET);
+	return 0;
+}
+
+static void advertise(void)
+{
+	static const ble_uuid16_t uuids[] = { BLE_UUID16_INIT(CTS_SERVICE_UUID) };
+	const char *name = ble_svc_gap_device_name();
+	struct ble_hs_adv_fields fields = {
+		.flags = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP,
+		.uuids16 = uuids,
+		.num_uuids16 = 1,
+		.uuids16_is_complete = 1,
+		.name = (const uint8_t *)name,
+		.name_len = strlen(name),
+		.name_is_complete = 1,
+	};
+	struct ble_gap_adv_params params = {
+		.conn_mode = BLE_GAP_CONN_MODE_UND,
+		.disc_mode = BLE_GAP_DISC_MODE_GEN,
+		.itvl_min = BLE_GAP_ADV_ITVL_MS(BLE_CTS_ADV_ITVL_MS),
+		.itvl_max = BLE_GAP_ADV_ITVL_MS(BLE_CTS_ADV_ITVL_MS),
+	};
+	int rc = ble_gap_adv_set_fields(&fields);
+	if (rc == 0) rc = ble_gap_adv_start(ctx.own_addr_type, NULL, BLE_HS_FOREVER, &params, gap_event, NULL);
+	if (rc != 0) ESP_LOGE(TAG, "Could not advertise: %d", rc);
+}
+
+static int gap_event(struct ble_gap_event *event, void *arg)
+{
+	switch (event->type) {
+	case BLE_GAP_EVENT_CONNECT:
+		if (event->connect.status != 0) {
+			if (!ctx.stopping) advertise();
+			break;
+		}
+		ESP_LOGI(TAG, "Phone connected");
+		ctx.conn = event->connect.conn_handle;
+		ctx.local_info = false;
+		break;
+	case BLE_GAP_EVENT_DISCONNECT:
+		ESP_LOGI(TAG, "Phone disconnected, reason 0x%x", event->disconnect.reason);
+		ctx.conn = BLE_HS_CONN_HANDLE_NONE;
+		xEventGroupSetBits(ctx.events, DISCONNECTED);
+		if (!ctx.stopping) advertise();
+		break;
+	case BLE_GAP_EVENT_ADV_COMPLETE:
+		if (!ctx.stopping) advertise();
+		break;
+	case BLE_GAP_EVENT_REPEAT_PAIRING: {
+		// the phone lost its keys; only pair it again while pairing is open
+		if (!ctx.allow_pairing) return BLE_GAP_REPEAT_PAIRING_IGNORE;
+		struct ble_gap_conn_desc desc;
+		if (ble_gap_conn_find(event->repeat_pairing.conn_handle, &desc) == 0) ble_store_util_delete_peer(&desc.peer_id_addr);
+		return BLE_GAP_REPEAT_PAIRING_RETRY;
+	}
+	}
+	return 0;
+}
+
+static void on_sync(void)
+{
+	if (ble_hs_util_ensure_addr(0) != 0 || ble_hs_id_infer_auto(0, &ctx.own_addr_type) != 0) {
+		ESP_LOGE(TAG, "No Bluetooth address");
+		return;
+	}
+	advertise();
+}
+
+static void on_reset(int reason)
+{
+	ESP_LOGW(TAG, "Host reset, reason %d", reason);
+}
+
+static void host_task(void *param)
+{
+	nimble_port_run();
+	nimble_port_freertos_deinit();
+}
+
+esp_err_t ble_cts_sync(tz_t *tz, int timeout_ms, bool allow_pairing, int64_t max_adjust_us, ble_cts_stats_t *stats)
+{
+	if (!tz || timeout_ms <= 0 || max_adjust_us < 0) return ESP_ERR_INVALID_ARG;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.tz = tz;
+	ctx.allow_pairing = allow_pairing;
+	ctx.max_adjust_us = max_adjust_us;
+	ctx.conn = BLE_HS_CONN_HANDLE_NONE;
+	ctx.events = xEventGroupCreate();
+	if (!ctx.events) return ESP_ERR_NO_MEM;
+
+	int64_t start = esp_timer_get_time();
+	esp_err_t res = nimble_port_init();
+	if (res != ESP_OK) {
+		vEventGroupDelete(ctx.events);
+		return res;
+	}
+	ble_hs_cfg.sync_cb = on_sync;
+	ble_hs_cfg.reset_cb = on_reset;
+	ble_hs_cfg.store_status_cb = ble_store_util_status_rr;
+	// Just Works, encrypted; only new bonds made while pairing is open count
+	ble_hs_cfg.sm_io_cap = BLE_SM_IO_CAP_NO_IO;
+	ble_hs_cfg.sm_bonding = allow_pairing;
+	ble_hs_cfg.sm_sc = 1;
+	ble_hs_cfg.sm_our_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
+	ble_hs_cfg.sm_their_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
+	ble_store_config_init();
+	ble_svc_gap_init();
+	ble_svc_gatt_init();
+	if (ble_gatts_count_cfg(services) != 0
+		|| ble_gatts_add_svcs(services) != 0
+		|| ble_svc_gap_device_name_set(BLE_CTS_DEVICE_NAME) != 0) {
+		nimble_port_deinit();
+		vEventGroupDelete(ctx.events);
+		return ESP_FAIL;
+	}
+	nimble_port_freertos_init(host_task);
+
+	EventBits_t bits = xEventGroupWaitBits(ctx.events, TIME_SET, pdFALSE, pdFALSE, pdMS_TO_TICKS(timeout_ms));
+	res = bits & TIME_SET ? ESP_OK : ESP_ERR_TIMEOUT;
+
+	// the phone may hang up itself once its write is acknowledged
+	ctx.stopping = true;
+	ble_gap_adv_stop();
+	if (ctx.conn != BLE_HS_CONN_HANDLE_NONE) {
+		bits = xEventGroupWaitBits(ctx.events, DISCONNECTED, pdFALSE, pdFALSE, pdMS_TO_TICKS(BLE_CTS_HANGUP_MS));
+		if (!(bits & DISCONNECTED) && ble_gap_terminate(ctx.conn, BLE_ERR_REM_USER_CONN_TERM) == 0) {
+			xEventGroupWaitBits(ctx.events, DISCONNECTED, pdFALSE, pdFALSE, pdMS_TO_TICKS(BLE_CTS_HANGUP_MS));
+		}
+	}
+	nimble_port_stop();
+	nimble_port_deinit();
+	vEventGroupDelete(ctx.events);
+
+	if (stats) {
+		stats->wait_us = res == ESP_OK ? ctx.set_at - start : esp_timer_get_time() - start;
+		stats->adjust_us = res == ESP_OK ? ctx.adjust_us : 0;
+		stats->local_info = res == ESP_OK && ctx.local_info;
+	}
+	return res;
+}
+#else
+esp_err_t ble_cts_sync(tz_t *tz, int timeout_ms, bool allow_pairing, int64_t max_adjust_us, ble_cts_stats_t *stats)
+{
+	return ESP_ERR_NOT_SUPPORTED;
+}
+#endif
@@ -0,0 +1,34 @@
+#ifndef MAIN_BLE_CTS_H_
+#define MAIN_BLE_CTS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "tz.h"
+
+#define BLE_CTS_DEVICE_NAME "DS3231 watch"
+#define BLE_CTS_ADV_ITVL_MS 500		// advertise this often while waiting; the open app scans continuously
+
+typedef struct {
+	int64_t wait_us;		// start of advertising to the phone's write
+	int64_t adjust_us;		// how far the system clock moved
+	bool local_info;		// the phone also sent its zone and DST offset
+} ble_cts_stats_t;
+
+// Time from the phone over the Bluetooth Current Time Service (0x1805), no
+// Wi-Fi needed. Starts NimBLE, advertises as a CTS server and waits for a
+// connected phone to write Current Time (0x2A2B): local time with a 1/256 s
+// fraction, which the phone has already moved forward by half a measured
+// round trip. If it wrote Local Time Information (0x2A0F) first, that offset
+// turns the local time into UTC; 'tz' does otherwise. Reception sets the
+// system clock, and the stack is torn down again before this returns, with
+// ESP_ERR_TIMEOUT if nothing came in 'timeout_ms'. Reads of Current Time
+// return the watch's own clock, so the phone can show the error before it
+// writes. 'stats', if not NULL, gets how it went.
+// Writes need an encrypted link to a bonded phone. New bonds are only made
+// with 'allow_pairing', so only while the user is setting the watch up. A
+// time more than 'max_adjust_us' from the system clock is refused, 0 for
+// no limit.
+esp_err_t ble_cts_sync(tz_t *tz, int timeout_ms, bool allow_pairing, int64_t max_adjust_us, ble_cts_stats_t *stats);
+#endif /* MAIN_BLE_CTS_H_ */
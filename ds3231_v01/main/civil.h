@@ -0,0 +1,38 @@
+#ifndef MAIN_CIVIL_H_
+#define MAIN_CIVIL_H_
+
+#include <stdint.h>
+
+// Days since 1970-01-01 of a Gregorian date, month 1-12 (H. Hinnant's
+// days_from_civil). Plain integer arithmetic, no libc or TZ state.
+static inline int32_t days_from_civil(int32_t y, uint32_t m, uint32_t d)
+{
+	y -= m <= 2;
+	const int32_t era = (y >= 0 ? y : y - 399) / 400;
+	const uint32_t yoe = y - era * 400;
+	const uint32_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	const uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + (int32_t)doe - 719468;
+}
+
+// Inverse of days_from_civil().
+static inline void civil_from_days(int32_t z, int32_t *y, uint32_t *m, uint32_t *d)
+{
+	z += 719468;
+	const int32_t era = (z >= 0 ? z : z - 146096) / 146097;
+	const uint32_t doe = z - era * 146097;
+	const uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	const uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	const uint32_t mp = (5 * doy + 2) / 153;
+	*d = doy - (153 * mp + 2) / 5 + 1;
+	*m = mp < 10 ? mp + 3 : mp - 9;
+	*y = (int32_t)yoe + era * 400 + (*m <= 2);
+}
+
+// 0 = Sunday, as tm_wday.
+static inline uint32_t weekday_from_days(int32_t z)
+{
+	const int32_t w = (z + 4) % 7;	/* 1970-01-01 was a Thursday */
+	return w < 0 ? w + 7 : w;
+}
+#endif /* MAIN_CIVIL_H_ */
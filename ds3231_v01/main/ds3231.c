@@ -4,11 +4,52 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_attr.h"
 
 #include "ds3231.h"
+#include "civil.h"
 
 #define CHECK_ARG(ARG) do { if (!ARG) return ESP_ERR_INVALID_ARG; } while (0)
 
+#define REG_BIT(REG) (1UL << (REG))
+#define REG_SPAN(REG, SIZE) ((REG_BIT(SIZE) - 1) << (REG))
+
+/* Bits the chip changes on its own. Registers with all bits volatile are not
+ * shadowed; in the others the volatile bits are kept 0 in the shadow. */
+static const uint8_t volatile_bits[DS3231_REGS] = {
+	[DS3231_ADDR_TIME ... DS3231_ADDR_TIME + 6] = 0xff,
+	[DS3231_ADDR_CONTROL] = DS3231_CTRL_TEMPCONV,
+	[DS3231_ADDR_STATUS] = (uint8_t)~DS3231_STAT_32KHZ,
+	[DS3231_ADDR_TEMP ... DS3231_ADDR_TEMP + 1] = 0xff,
+};
+
+/* Shadow of the register map. Alarm, control and aging registers only change
+ * when we write them, so they are read from the chip once and then served
+ * from here. It lives in RTC memory and stays valid across deep sleep; a
+ * power-on starts with nothing valid. */
+typedef struct {
+	i2c_port_t port;
+	uint32_t valid;		// one bit per register
+	uint32_t dirty;		// changed here, not yet written to the chip
+	uint8_t regs[DS3231_REGS];
+} ds3231_shadow_t;
+
+RTC_DATA_ATTR static ds3231_shadow_t shadow;
+
+/* Last temperature read and the RTC time it was read at. The chip only
+ * updates the registers once per conversion cycle, so ds3231_get_time_temp()
+ * serves the value from here for a while. The phase of the cycle is not
+ * known, and a value read just before a conversion is already a cycle old;
+ * reusing it for half a cycle keeps what is served at most 1.5 cycles (96 s)
+ * old, rather than two. Timed by the RTC itself, it stays valid across deep
+ * sleep. */
+typedef struct {
+	time_t epoch;		// RTC time of the reading, 0 if none
+	int16_t raw;		// 0.25 deg Cel steps
+} ds3231_temp_cache_t;
+
+RTC_DATA_ATTR static ds3231_temp_cache_t temp_cache;
+
 uint8_t bcd2dec(uint8_t val)
 {
 	return (val >> 4) * 10 + (val & 0x0f);
@@ -19,6 +60,149 @@ uint8_t dec2bcd(uint8_t val)
 	return ((val / 10) << 4) + (val % 10);
 }
 
+/* The time block is converted as one little-endian word, register n in byte
+ * n. BCD_LANES() repeats a byte in every lane. */
+#define BCD_LANES(B) (0x0101010101010101ULL * (B))
+#define BCD_LANES16(W) (0x0001000100010001ULL * (W))
+/* Value bits of each time register: the century, 12/24 and unused bits are
+ * dropped. 12 h mode narrows the hour to 5 bits, see ds3231_bcd_unpack(). */
+#define BCD_TIME_MASKS 0x00ff1f3f073f7f7fULL
+
+/* Converts the 7 time registers to binary fields: seconds, minutes, hour
+ * digits (1-12 in 12 h mode), weekday, date, month and the 2-digit year.
+ * Returns false if any nibble is above 9, checked in the same pass. */
+bool ds3231_bcd_unpack(const uint8_t *regs, uint8_t *dec)
+{
+	uint64_t x = 0;
+	memcpy(&x, regs, 7);
+	x &= BCD_TIME_MASKS & ~((uint64_t)(regs[2] & DS3231_12HOUR_FLAG) >> 1 << 16);
+
+	/* a nibble above 9 carries into bit 4 once 6 is added */
+	uint64_t hi = x >> 4 & BCD_LANES(0x0f);
+	uint64_t lo = x & BCD_LANES(0x0f);
+	uint64_t bad = ((hi + BCD_LANES(0x06)) | (lo + BCD_LANES(0x06))) & BCD_LANES(0x10);
+
+	/* 16 * hi + lo - 6 * hi, no lane borrows or overflows */
+	x -= hi * 6;
+	memcpy(dec, &x, 7);
+	return !bad;
+}
+
+/* Inverse of ds3231_bcd_unpack() for fields below 100. The tens are
+ * v * 103 >> 10, worked out in 16-bit lanes so the products cannot spill
+ * into the next field. */
+void ds3231_bcd_pack(const uint8_t *dec, uint8_t *regs)
+{
+	uint64_t x = 0;
+	memcpy(&x, dec, 7);
+
+	uint64_t even = (x & BCD_LANES16(0xff)) * 103 >> 10 & BCD_LANES16(0x0f);
+	uint64_t odd = (x >> 8 & BCD_LANES16(0xff)) * 103 >> 10 & BCD_LANES16(0x0f);
+	x += (even | odd << 8) * 6;
+	memcpy(regs, &x, 7);
+}
+
+/* Drops every shadowed register, e.g. after the RTC lost power. */
+void ds3231_invalidate_cache(void)
+{
+	shadow.valid = 0;
+	shadow.dirty = 0;
+	temp_cache.epoch = 0;
+}
+
+static void shadow_attach(i2c_dev_t *dev)
+{
+	if (shadow.port == dev->port) return;
+	ds3231_invalidate_cache();
+	shadow.port = dev->port;
+}
+
+/* Reads the registers of the span that are not valid yet. Dirty registers are
+ * valid too, so local changes are never overwritten. */
+static esp_err_t shadow_load(i2c_dev_t *dev, uint8_t reg, size_t size)
+{
+	shadow_attach(dev);
+	uint32_t span = REG_SPAN(reg, size);
+	if ((shadow.valid & span) == span) return ESP_OK;
+
+	uint8_t data[DS3231_REGS];
+	esp_err_t res = i2c_dev_read_reg(dev, reg, data, size);
+	if (res != ESP_OK) return res;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		uint8_t r = reg + i;
+		if (shadow.valid & REG_BIT(r)) continue;
+		shadow.regs[r] = data[i] & ~volatile_bits[r];
+		shadow.valid |= REG_BIT(r);
+	}
+	return ESP_OK;
+}
+
+/* Serves a span of fully static registers, reading it only once. */
+static esp_err_t shadow_read(i2c_dev_t *dev, uint8_t reg, uint8_t *data, size_t size)
+{
+	esp_err_t res = shadow_load(dev, reg, size);
+	if (res == ESP_OK)
+		memcpy(data, &shadow.regs[reg], size);
+
+	return res;
+}
+
+static void shadow_set(uint8_t reg, uint8_t val)
+{
+	val &= ~volatile_bits[reg];
+	if ((shadow.valid & REG_BIT(reg)) && shadow.regs[reg] == val) return;
+	shadow.regs[reg] = val;
+	shadow.valid |= REG_BIT(reg);
+	shadow.dirty |= REG_BIT(reg);
+}
+
+/* Keeps the static bits of a status register that was read anyway. */
+static void shadow_status(i2c_dev_t *dev, uint8_t status)
+{
+	shadow_attach(dev);
+	shadow.regs[DS3231_ADDR_STATUS] = status & ~volatile_bits[DS3231_ADDR_STATUS];
+	shadow.valid |= REG_BIT(DS3231_ADDR_STATUS);
+}
+
+/* Writes the dirty registers back. A run of dirty registers goes out in one
+ * transaction, bridging clean shadowed ones in between; registers with
+ * volatile bits end a run. Registers that fail to write stay dirty and are
+ * retried by the next flush. */
+esp_err_t ds3231_flush(i2c_dev_t *dev)
+{
+	CHECK_ARG(dev);
+
+	shadow_attach(dev);
+	while (shadow.dirty)
+	{
+		uint8_t first = __builtin_ctz(shadow.dirty);
+		uint8_t last = first;
+		for (uint8_t r = first + 1; r < DS3231_REGS; r++)
+		{
+			if (volatile_bits[r] || !(shadow.valid & REG_BIT(r))) break;
+			if (shadow.dirty & REG_BIT(r)) last = r;
+		}
+
+		esp_err_t res = i2c_dev_write_reg(dev, first, &shadow.regs[first], last - first + 1);
+		if (res != ESP_OK) return res;
+		shadow.dirty &= ~REG_SPAN(first, last - first + 1);
+	}
+	return ESP_OK;
+}
+
+/* Read-modify-write of a shadowed register: only reaches the bus to fill the
+ * shadow and, if the value changed, to write it back. */
+static esp_err_t shadow_update(i2c_dev_t *dev, uint8_t reg, uint8_t mask, uint8_t bits)
+{
+	esp_err_t res = shadow_load(dev, reg, 1);
+	if (res != ESP_OK) return res;
+
+	shadow_set(reg, (shadow.regs[reg] & ~mask) | (bits & mask));
+	return ds3231_flush(dev);
+}
+
 esp_err_t ds3231_init_desc(i2c_dev_t *dev, i2c_port_t port, gpio_num_t sda_gpio, gpio_num_t scl_gpio)
 {
 	CHECK_ARG(dev);
@@ -28,7 +212,19 @@ esp_err_t ds3231_init_desc(i2c_dev_t *dev, i2c_port_t port, gpio_num_t sda_gpio,
 	dev->sda_io_num = sda_gpio;
 	dev->scl_io_num = scl_gpio;
 	dev->clk_speed = I2C_FREQ_HZ;
-	return i2c_dev_init(port, sda_gpio, scl_gpio);
+	dev->max_clk_speed = I2C_FREQ_HZ;	/* the DS3231 is a fast-mode (400 kHz) part */
+	dev->prio = I2C_DEV_PRIO_NORMAL;
+	dev->retries = I2CDEV_RETRIES;
+	esp_err_t res = i2c_dev_init(port, sda_gpio, scl_gpio);
+	if (res != ESP_OK) return res;
+	return i2c_dev_add(dev);
+}
+
+esp_err_t ds3231_free_desc(i2c_dev_t *dev)
+{
+	CHECK_ARG(dev);
+
+	return i2c_dev_remove(dev);
 }
 
 esp_err_t ds3231_set_time(i2c_dev_t *dev, struct tm *time)
@@ -39,16 +235,18 @@ esp_err_t ds3231_set_time(i2c_dev_t *dev, struct tm *time)
 	uint8_t data[7];
 
 	/* time/date data */
-	data[0] = dec2bcd(time->tm_sec);
-	data[1] = dec2bcd(time->tm_min);
-	data[2] = dec2bcd(time->tm_hour);
+	data[0] = time->tm_sec;
+	data[1] = time->tm_min;
+	data[2] = time->tm_hour;
 	/* The week data must be in the range 1 to 7, and to keep the start on the
 	 * same day as for tm_wday have it start at 1 on Sunday. */
-	data[3] = dec2bcd(time->tm_wday + 1);
-	data[4] = dec2bcd(time->tm_mday);
-	data[5] = dec2bcd(time->tm_mon + 1);
-	data[6] = dec2bcd(time->tm_year - 2000);
+	data[3] = time->tm_wday + 1;
+	data[4] = time->tm_mday;
+	data[5] = time->tm_mon + 1;
+	data[6] = time->tm_year - 2000;
+	ds3231_bcd_pack(data, data);
 
+	temp_cache.epoch = 0;	/* timed by the RTC, which is about to jump */
 	return i2c_dev_write_reg(dev, DS3231_ADDR_TIME, data, 7);
 }
 
@@ -57,9 +255,19 @@ esp_err_t ds3231_get_raw_temp(i2c_dev_t *dev, int16_t *temp)
 	CHECK_ARG(dev);
 	CHECK_ARG(temp);
 
+	uint8_t reg = DS3231_ADDR_TEMP;
 	uint8_t data[2];
 
-	esp_err_t res = i2c_dev_read_reg(dev, DS3231_ADDR_TEMP, data, sizeof(data));
+	/* temperature polls yield the bus to latency-sensitive sensors */
+	i2c_dev_xfer_t xfer = {
+		.dev = dev,
+		.out_reg = &reg,
+		.out_reg_size = 1,
+		.in_data = data,
+		.in_size = sizeof(data),
+		.prio = I2C_DEV_PRIO_LOW,
+	};
+	esp_err_t res = i2c_dev_transfer(&xfer);
 	if (res == ESP_OK)
 		*temp = (int16_t)(int8_t)data[0] << 2 | data[1] >> 6;
 
@@ -92,6 +300,45 @@ esp_err_t ds3231_get_temp_float(i2c_dev_t *dev, float *temp)
 	return res;
 }
 
+/* 'digits' is the converted hour field of register 'data' */
+static int hour_from(uint8_t data, int digits)
+{
+	if (data & DS3231_12HOUR_FLAG)
+	{
+		/* 12H */
+		int hour = digits - 1;
+		/* AM/PM? */
+		if (data & DS3231_PM_FLAG) hour += 12;
+		return hour;
+	}
+	return digits; /* 24H */
+}
+
+static int decode_hour(uint8_t data)
+{
+	return hour_from(data, bcd2dec(data & (data & DS3231_12HOUR_FLAG ? DS3231_12HOUR_MASK : 0x3f)));
+}
+
+/* Returns false if the registers hold a digit above 9. */
+bool ds3231_decode_time(const uint8_t *data, struct tm *time)
+{
+	uint8_t f[7];
+	bool valid = ds3231_bcd_unpack(data, f);
+
+	/* convert to unix time structure */
+	time->tm_sec = f[0];
+	time->tm_min = f[1];
+	time->tm_hour = hour_from(data[2], f[2]);
+	time->tm_wday = f[3] - 1;
+	time->tm_mday = f[4];
+	time->tm_mon  = f[5] - 1;
+	time->tm_year = f[6] + 2000;
+	time->tm_isdst = 0;
+
+	/* UTC, tz_localtime() gives the local time */
+	return valid;
+}
+
 esp_err_t ds3231_get_time(i2c_dev_t *dev, struct tm *time)
 {
 	CHECK_ARG(dev);
@@ -103,25 +350,382 @@ esp_err_t ds3231_get_time(i2c_dev_t *dev, struct tm *time)
 	esp_err_t res = i2c_dev_read_reg(dev, DS3231_ADDR_TIME, data, 7);
 		if (res != ESP_OK) return res;
 
-	/* convert to unix time structure */
-	time->tm_sec = bcd2dec(data[0]);
-	time->tm_min = bcd2dec(data[1]);
-	if (data[2] & DS3231_12HOUR_FLAG)
+	return ds3231_decode_time(data, time) ? ESP_OK : ESP_ERR_INVALID_RESPONSE;
+}
+
+/* The RTC keeps UTC, see tz.h for local time. Returns -1 if the registers
+ * hold a digit above 9. */
+time_t ds3231_decode_epoch(const uint8_t *data)
+{
+	uint8_t f[7];
+	if (!ds3231_bcd_unpack(data, f)) return -1;
+
+	int32_t days = days_from_civil(f[6] + 2000, f[5], f[4]);
+	return (time_t)days * 86400 + hour_from(data[2], f[2]) * 3600 + f[1] * 60 + f[0];
+}
+
+esp_err_t ds3231_get_epoch(i2c_dev_t *dev, time_t *epoch)
+{
+	CHECK_ARG(dev);
+	CHECK_ARG(epoch);
+
+	uint8_t data[7];
+	esp_err_t res = i2c_dev_read_reg(dev, DS3231_ADDR_TIME, data, 7);
+	if (res != ESP_OK) return res;
+
+	*epoch = ds3231_decode_epoch(data);
+	return *epoch < 0 ? ESP_ERR_INVALID_RESPONSE : ESP_OK;
+}
+
+/* Only 2000-01-01 to 2099-12-31 fit the year register. */
+esp_err_t ds3231_set_epoch(i2c_dev_t *dev, time_t epoch)
+{
+	CHECK_ARG(dev);
+	if (epoch < DS3231_EPOCH_MIN || epoch > DS3231_EPOCH_MAX) return ESP_ERR_INVALID_ARG;
+
+	int32_t days = epoch / 86400;
+	uint32_t secs = epoch % 86400;
+	int32_t year;
+	uint32_t month, mday;
+	civil_from_days(days, &year, &month, &mday);
+
+	uint8_t data[7];
+	data[0] = secs % 60;
+	data[1] = secs / 60 % 60;
+	data[2] = secs / 3600;
+	data[3] = weekday_from_days(days) + 1;	/* Sunday is 1 */
+	data[4] = mday;
+	data[5] = month;
+	data[6] = year - 2000;
+	ds3231_bcd_pack(data, data);
+
+	temp_cache.epoch = 0;
+	return i2c_dev_write_reg(dev, DS3231_ADDR_TIME, data, 7);
+}
+
+/* The temperature comes from the cache while the chip cannot have converted
+ * since it was read, so most calls only read the time. */
+esp_err_t ds3231_get_time_temp(i2c_dev_t *dev, struct tm *time, float *temp)
+{
+	CHECK_ARG(dev);
+	CHECK_ARG(time);
+	CHECK_ARG(temp);
+
+	uint8_t data[7];
+	uint8_t t[2];
+	i2c_dev_span_t spans[] = {
+		{ .reg = DS3231_ADDR_TIME, .data = data, .size = sizeof(data) },
+		{ .reg = DS3231_ADDR_TEMP, .data = t, .size = sizeof(t) },
+	};
+
+	bool cached = temp_cache.epoch != 0;
+	esp_err_t res = i2c_dev_readv(dev, spans, cached ? 1 : 2);
+	if (res != ESP_OK) return res;
+
+	if (!ds3231_decode_time(data, time)) return ESP_ERR_INVALID_RESPONSE;
+	time_t now = ds3231_decode_epoch(data);
+	if (cached)
 	{
-		/* 12H */
-		time->tm_hour = bcd2dec(data[2] & DS3231_12HOUR_MASK) - 1;
-		/* AM/PM? */
-		if (data[2] & DS3231_PM_FLAG) time->tm_hour += 12;
+		if (now >= temp_cache.epoch && now - temp_cache.epoch < DS3231_TEMP_TTL_S)
+		{
+			*temp = temp_cache.raw * 0.25;
+			return ESP_OK;
+		}
+		res = ds3231_get_raw_temp(dev, &temp_cache.raw);
+		if (res != ESP_OK) return res;
 	}
-	else time->tm_hour = bcd2dec(data[2]); /* 24H */
-	time->tm_wday = bcd2dec(data[3]) - 1;
-	time->tm_mday = bcd2dec(data[4]);
-	time->tm_mon  = bcd2dec(data[5] & DS3231_MONTH_MASK) - 1;
-	time->tm_year = bcd2dec(data[6]) + 2000;
-	time->tm_isdst = 0;
+	else temp_cache.raw = (int16_t)(int8_t)t[0] << 2 | t[1] >> 6;
+
+	temp_cache.epoch = now;
+	*temp = temp_cache.raw * 0.25;
+	return ESP_OK;
+}
 
-	// apply a time zone (if you are not using localtime on the rtc or you want to check/apply DST)
-	//applyTZ(time);
+/* ds3231_get_time_temp() for a caller that already has the time, such as the
+ * system clock seeded from the RTC: no bus traffic while the cache holds. */
+esp_err_t ds3231_get_temp_at(i2c_dev_t *dev, time_t now, float *temp)
+{
+	CHECK_ARG(dev);
+	CHECK_ARG(temp);
+
+	if (!temp_cache.epoch || now < temp_cache.epoch || now - temp_cache.epoch >= DS3231_TEMP_TTL_S)
+	{
+		esp_err_t res = ds3231_get_raw_temp(dev, &temp_cache.raw);
+		if (res != ESP_OK) return res;
+		temp_cache.epoch = now;
+	}
+	*temp = temp_cache.raw * 0.25;
+	return ESP_OK;
+}
+
+/* Waits until neither a forced (CONV) nor an automatic (BSY) conversion is
+ * running. */
+static esp_err_t wait_conversion(i2c_dev_t *dev)
+{
+	for (int waited = 0; ; waited += DS3231_CONV_POLL_MS)
+	{
+		uint8_t regs[2];	/* control, status */
+		esp_err_t res = i2c_dev_read_reg(dev, DS3231_ADDR_CONTROL, regs, sizeof(regs));
+		if (res != ESP_OK) return res;
+		if (!(regs[0] & DS3231_CTRL_TEMPCONV) && !(regs[1] & DS3231_STAT_BUSY)) return ESP_OK;
+		if (waited >= DS3231_CONV_TIMEOUT_MS) return ESP_ERR_TIMEOUT;
+		vTaskDelay(pdMS_TO_TICKS(DS3231_CONV_POLL_MS));
+	}
+}
+
+/* Forces a temperature conversion and waits for it, about 200 ms. CONV must
+ * not be set during an automatic conversion, so one in progress is waited
+ * out first. */
+esp_err_t ds3231_convert_temp(i2c_dev_t *dev)
+{
+	CHECK_ARG(dev);
+
+	esp_err_t res = wait_conversion(dev);
+	if (res != ESP_OK) return res;
+	res = shadow_load(dev, DS3231_ADDR_CONTROL, 1);
+	if (res != ESP_OK) return res;
+
+	/* CONV is volatile and stays out of the shadow */
+	uint8_t ctrl = shadow.regs[DS3231_ADDR_CONTROL] | DS3231_CTRL_TEMPCONV;
+	res = i2c_dev_write_reg(dev, DS3231_ADDR_CONTROL, &ctrl, 1);
+	if (res != ESP_OK) return res;
+
+	temp_cache.epoch = 0;
+	return wait_conversion(dev);
+}
+
+/* For when a reading up to a conversion cycle old will not do. */
+esp_err_t ds3231_get_temp_fresh(i2c_dev_t *dev, float *temp)
+{
+	CHECK_ARG(temp);
+
+	esp_err_t res = ds3231_convert_temp(dev);
+	if (res != ESP_OK) return res;
+
+	struct tm time;
+	return ds3231_get_time_temp(dev, &time, temp);
+}
+
+/* Alarm registers hold seconds (alarm 1 only), minutes, hours and day, each
+ * with a mask bit in bit 7. The first 'match' fields are compared, the rest
+ * are masked out. */
+static void encode_alarm(uint8_t *data, const struct tm *time, bool has_sec, int match, bool wday)
+{
+	uint8_t values[4] = { 0 };
+	if (time)
+	{
+		values[0] = dec2bcd(time->tm_sec);
+		values[1] = dec2bcd(time->tm_min);
+		values[2] = dec2bcd(time->tm_hour);
+		values[3] = wday ? dec2bcd(time->tm_wday + 1) | DS3231_ALARM_WDAY : dec2bcd(time->tm_mday);
+	}
+
+	int first = has_sec ? 0 : 1;
+	for (int i = first; i < 4; i++)
+		data[i - first] = i - first < match ? values[i] : DS3231_ALARM_NOTSET;
+}
+
+/* Returns the number of compared fields, or -1 for a mask pattern the chip
+ * does not define. */
+static int decode_alarm(const uint8_t *data, struct tm *time, bool has_sec, bool *wday)
+{
+	int count = has_sec ? 4 : 3;
+	int match = 0;
+	while (match < count && !(data[match] & DS3231_ALARM_NOTSET)) match++;
+	for (int i = match; i < count; i++)
+	{
+		if (!(data[i] & DS3231_ALARM_NOTSET)) return -1;
+	}
+
+	const uint8_t *d = has_sec ? data : data - 1;
+	uint8_t day = d[3];
+	memset(time, 0, sizeof(*time));
+	if (has_sec) time->tm_sec = bcd2dec(d[0] & 0x7f);
+	time->tm_min = bcd2dec(d[1] & 0x7f);
+	time->tm_hour = decode_hour(d[2] & 0x7f);
+	*wday = day & DS3231_ALARM_WDAY;
+	if (*wday) time->tm_wday = bcd2dec(day & 0x0f) - 1;
+	else time->tm_mday = bcd2dec(day & 0x3f);
+	return match;
+}
+
+/* Both alarms are written in one transaction when both are set. time1 and
+ * time2 may be NULL for the "every second" and "every minute" rates. */
+esp_err_t ds3231_set_alarm(i2c_dev_t *dev, ds3231_alarm_t alarms, struct tm *time1, ds3231_alarm1_rate_t option1,
+	struct tm *time2, ds3231_alarm2_rate_t option2)
+{
+	CHECK_ARG(dev);
+	if (alarms == DS3231_ALARM_NONE || alarms > DS3231_ALARM_BOTH) return ESP_ERR_INVALID_ARG;
+	if ((alarms & DS3231_ALARM_1) && (option1 > DS3231_ALARM1_MATCH_SECMINHOURDATE
+		|| (option1 != DS3231_ALARM1_EVERY_SECOND && !time1)))
+		return ESP_ERR_INVALID_ARG;
+	if ((alarms & DS3231_ALARM_2) && (option2 > DS3231_ALARM2_MATCH_MINHOURDATE
+		|| (option2 != DS3231_ALARM2_EVERY_MIN && !time2)))
+		return ESP_ERR_INVALID_ARG;
+
+	uint8_t data[7];
+	int i = 0;
+
+	/* alarm 1 data */
+	if (alarms & DS3231_ALARM_1)
+	{
+		int match = option1 > DS3231_ALARM1_MATCH_SECMINHOURDAY ? 4 : option1;
+		encode_alarm(&data[i], time1, true, match, option1 == DS3231_ALARM1_MATCH_SECMINHOURDAY);
+		i += 4;
+	}
+
+	/* alarm 2 data */
+	if (alarms & DS3231_ALARM_2)
+	{
+		int match = option2 > DS3231_ALARM2_MATCH_MINHOURDAY ? 3 : option2;
+		encode_alarm(&data[i], time2, false, match, option2 == DS3231_ALARM2_MATCH_MINHOURDAY);
+		i += 3;
+	}
+
+	/* only the bytes that differ from the chip go out */
+	uint8_t reg = alarms & DS3231_ALARM_1 ? DS3231_ADDR_ALARM1 : DS3231_ADDR_ALARM2;
+	shadow_attach(dev);
+	for (int j = 0; j < i; j++) shadow_set(reg + j, data[j]);
+	return ds3231_flush(dev);
+}
+
+/* Reads both alarms back. Any of the output pointers may be NULL. */
+esp_err_t ds3231_get_alarm(i2c_dev_t *dev, struct tm *time1, ds3231_alarm1_rate_t *option1,
+	struct tm *time2, ds3231_alarm2_rate_t *option2)
+{
+	CHECK_ARG(dev);
+
+	uint8_t data[7];
+	esp_err_t res = shadow_read(dev, DS3231_ADDR_ALARM1, data, sizeof(data));
+	if (res != ESP_OK) return res;
+
+	struct tm t;
+	bool wday;
+	int match = decode_alarm(data, &t, true, &wday);
+	if (match < 0) return ESP_ERR_INVALID_RESPONSE;
+	if (time1) *time1 = t;
+	if (option1)
+		*option1 = match < 4 ? match : wday ? DS3231_ALARM1_MATCH_SECMINHOURDAY : DS3231_ALARM1_MATCH_SECMINHOURDATE;
 
+	match = decode_alarm(&data[4], &t, false, &wday);
+	if (match < 0) return ESP_ERR_INVALID_RESPONSE;
+	if (time2) *time2 = t;
+	if (option2)
+		*option2 = match < 3 ? match : wday ? DS3231_ALARM2_MATCH_MINHOURDAY : DS3231_ALARM2_MATCH_MINHOURDATE;
 	return ESP_OK;
 }
+
+/* The ds3231_alarm_t bits line up with the A1F/A2F status flags and the
+ * A1IE/A2IE control bits. */
+esp_err_t ds3231_get_alarm_flags(i2c_dev_t *dev, ds3231_alarm_t *alarms)
+{
+	CHECK_ARG(dev);
+	CHECK_ARG(alarms);
+
+	uint8_t status;
+	esp_err_t res = i2c_dev_read_reg(dev, DS3231_ADDR_STATUS, &status, 1);
+	if (res != ESP_OK) return res;
+
+	shadow_status(dev, status);
+
+	*alarms = status & (DS3231_STAT_ALARM_1 | DS3231_STAT_ALARM_2);
+	return ESP_OK;
+}
+
+/* Turns INT/SQW into the square-wave output; alarm interrupts no longer reach
+ * the pin. At 1 Hz the falling edge is where the seconds register counts. */
+esp_err_t ds3231_enable_squarewave(i2c_dev_t *dev, ds3231_sqwave_freq_t freq)
+{
+	CHECK_ARG(dev);
+	if (freq & ~DS3231_CTRL_SQWAVE_RATE) return ESP_ERR_INVALID_ARG;
+
+	return shadow_update(dev, DS3231_ADDR_CONTROL, DS3231_CTRL_ALARM_INTS | DS3231_CTRL_SQWAVE_RATE, freq);
+}
+
+/* Back to the alarm interrupt output. */
+esp_err_t ds3231_disable_squarewave(i2c_dev_t *dev)
+{
+	CHECK_ARG(dev);
+
+	return shadow_update(dev, DS3231_ADDR_CONTROL, DS3231_CTRL_ALARM_INTS, DS3231_CTRL_ALARM_INTS);
+}
+
+/* OSF is set when the oscillator stopped, e.g. because both supplies were
+ * lost. The time, and every register in the shadow, are then not to be
+ * trusted, so the shadow is dropped. */
+esp_err_t ds3231_get_oscillator_stop_flag(i2c_dev_t *dev, bool *flag)
+{
+	CHECK_ARG(dev);
+	CHECK_ARG(flag);
+
+	uint8_t status;
+	esp_err_t res = i2c_dev_read_reg(dev, DS3231_ADDR_STATUS, &status, 1);
+	if (res != ESP_OK) return res;
+
+	if (status & DS3231_STAT_OSCILLATOR) ds3231_invalidate_cache();
+	shadow_status(dev, status);
+
+	*flag = status & DS3231_STAT_OSCILLATOR;
+	return ESP_OK;
+}
+
+/* Once the time has been set again. The alarm flags are left alone. */
+esp_err_t ds3231_clear_oscillator_stop_flag(i2c_dev_t *dev)
+{
+	CHECK_ARG(dev);
+
+	esp_err_t res = shadow_load(dev, DS3231_ADDR_STATUS, 1);
+	if (res != ESP_OK) return res;
+
+	uint8_t val = shadow.regs[DS3231_ADDR_STATUS] | DS3231_STAT_ALARM_1 | DS3231_STAT_ALARM_2;
+	return i2c_dev_write_reg(dev, DS3231_ADDR_STATUS, &val, 1);
+}
+
+/* Clearing the flag of an enabled alarm releases the INT/SQW pin. The flags
+ * can only be cleared, writing 1 leaves them alone, so with EN32kHz in the
+ * shadow this is a single write. */
+esp_err_t ds3231_clear_alarm_flags(i2c_dev_t *dev, ds3231_alarm_t alarms)
+{
+	CHECK_ARG(dev);
+
+	esp_err_t res = shadow_load(dev, DS3231_ADDR_STATUS, 1);
+	if (res != ESP_OK) return res;
+
+	uint8_t val = shadow.regs[DS3231_ADDR_STATUS] | ((DS3231_STAT_OSCILLATOR | DS3231_ALARM_BOTH) & ~alarms);
+	return i2c_dev_write_reg(dev, DS3231_ADDR_STATUS, &val, 1);
+}
+
+/* Switches INT/SQW from square wave to alarm output (INTCN) as well. */
+esp_err_t ds3231_enable_alarm_ints(i2c_dev_t *dev, ds3231_alarm_t alarms)
+{
+	CHECK_ARG(dev);
+
+	uint8_t bits = DS3231_CTRL_ALARM_INTS | (alarms & DS3231_ALARM_BOTH);
+	return shadow_update(dev, DS3231_ADDR_CONTROL, bits, bits);
+}
+
+esp_err_t ds3231_disable_alarm_ints(i2c_dev_t *dev, ds3231_alarm_t alarms)
+{
+	CHECK_ARG(dev);
+
+	return shadow_update(dev, DS3231_ADDR_CONTROL, alarms & DS3231_ALARM_BOTH, 0);
+}
+
+esp_err_t ds3231_get_aging_offset(i2c_dev_t *dev, int8_t *age)
+{
+	CHECK_ARG(dev);
+	CHECK_ARG(age);
+
+	return shadow_read(dev, DS3231_ADDR_AGING, (uint8_t *)age, 1);
+}
+
+/* Positive values slow the oscillator down, by about 0.1 ppm per LSB at 25
+ * deg Cel. The new offset applies from the next temperature conversion. */
+esp_err_t ds3231_set_aging_offset(i2c_dev_t *dev, int8_t age)
+{
+	CHECK_ARG(dev);
+
+	shadow_attach(dev);
+	shadow_set(DS3231_ADDR_AGING, (uint8_t)age);
+	return ds3231_flush(dev);
+}
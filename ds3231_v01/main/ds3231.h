@@ -3,7 +3,6 @@
 
 #include <time.h>
 #include <stdbool.h>
-#include "driver/i2c.h"
 
 #include "i2cdev.h"
 
@@ -23,6 +22,7 @@
 #define DS3231_CTRL_OSCILLATOR    0x80
 #define DS3231_CTRL_SQUAREWAVE_BB 0x40
 #define DS3231_CTRL_TEMPCONV      0x20
+#define DS3231_CTRL_SQWAVE_RATE   0x18
 #define DS3231_CTRL_ALARM_INTS    0x04
 #define DS3231_CTRL_ALARM2_INT    0x02
 #define DS3231_CTRL_ALARM1_INT    0x01
@@ -37,19 +37,88 @@
 #define DS3231_ADDR_STATUS  0x0f
 #define DS3231_ADDR_AGING   0x10
 #define DS3231_ADDR_TEMP    0x11
+#define DS3231_REGS         0x13
+
+#define DS3231_TEMP_PERIOD_S    64		//!< automatic temperature conversion period
+#define DS3231_TEMP_TTL_S       (DS3231_TEMP_PERIOD_S / 2)	//!< how long a read temperature is reused
+#define DS3231_CONV_TIMEOUT_MS  500		//!< a conversion takes about 200 ms
+#define DS3231_CONV_POLL_MS     10
+
+#define DS3231_EPOCH_MIN    946684800LL		//!< 2000-01-01 00:00:00
+#define DS3231_EPOCH_MAX    4102444799LL	//!< 2099-12-31 23:59:59
 
 #define DS3231_12HOUR_FLAG  0x40
 #define DS3231_12HOUR_MASK  0x1f
 #define DS3231_PM_FLAG      0x20
 #define DS3231_MONTH_MASK   0x1f
 
+typedef enum {
+	DS3231_ALARM_NONE = 0,
+	DS3231_ALARM_1,
+	DS3231_ALARM_2,
+	DS3231_ALARM_BOTH,
+} ds3231_alarm_t;
+
+typedef enum {
+	DS3231_SQWAVE_1HZ = 0x00,
+	DS3231_SQWAVE_1024HZ = 0x08,
+	DS3231_SQWAVE_4096HZ = 0x10,
+	DS3231_SQWAVE_8192HZ = 0x18,
+} ds3231_sqwave_freq_t;
+
+/* Alarm 1 fires when the listed fields match, "every second" matches none. */
+typedef enum {
+	DS3231_ALARM1_EVERY_SECOND = 0,
+	DS3231_ALARM1_MATCH_SEC,
+	DS3231_ALARM1_MATCH_SECMIN,
+	DS3231_ALARM1_MATCH_SECMINHOUR,
+	DS3231_ALARM1_MATCH_SECMINHOURDAY,	// day of the week, tm_wday
+	DS3231_ALARM1_MATCH_SECMINHOURDATE,	// day of the month, tm_mday
+} ds3231_alarm1_rate_t;
+
+/* Alarm 2 has no seconds register and fires at second 00. */
+typedef enum {
+	DS3231_ALARM2_EVERY_MIN = 0,
+	DS3231_ALARM2_MATCH_MIN,
+	DS3231_ALARM2_MATCH_MINHOUR,
+	DS3231_ALARM2_MATCH_MINHOURDAY,
+	DS3231_ALARM2_MATCH_MINHOURDATE,
+} ds3231_alarm2_rate_t;
+
 uint8_t bcd2dec(uint8_t val);
 uint8_t dec2bcd(uint8_t val);
+bool ds3231_bcd_unpack(const uint8_t *regs, uint8_t *dec);
+void ds3231_bcd_pack(const uint8_t *dec, uint8_t *regs);
 esp_err_t ds3231_init_desc(i2c_dev_t *dev, i2c_port_t port, gpio_num_t sda_gpio, gpio_num_t scl_gpio);
+esp_err_t ds3231_free_desc(i2c_dev_t *dev);
 esp_err_t ds3231_set_time(i2c_dev_t *dev, struct tm *time);
 esp_err_t ds3231_get_raw_temp(i2c_dev_t *dev, int16_t *temp);
 esp_err_t ds3231_get_temp_integer(i2c_dev_t *dev, int8_t *temp);
 esp_err_t ds3231_get_temp_float(i2c_dev_t *dev, float *temp);
 esp_err_t ds3231_get_time(i2c_dev_t *dev, struct tm *time);
+bool ds3231_decode_time(const uint8_t *data, struct tm *time);
+esp_err_t ds3231_get_epoch(i2c_dev_t *dev, time_t *epoch);
+esp_err_t ds3231_set_epoch(i2c_dev_t *dev, time_t epoch);
+time_t ds3231_decode_epoch(const uint8_t *data);
+esp_err_t ds3231_set_alarm(i2c_dev_t *dev, ds3231_alarm_t alarms, struct tm *time1, ds3231_alarm1_rate_t option1,
+	struct tm *time2, ds3231_alarm2_rate_t option2);
+esp_err_t ds3231_get_alarm(i2c_dev_t *dev, struct tm *time1, ds3231_alarm1_rate_t *option1,
+	struct tm *time2, ds3231_alarm2_rate_t *option2);
+esp_err_t ds3231_enable_squarewave(i2c_dev_t *dev, ds3231_sqwave_freq_t freq);
+esp_err_t ds3231_disable_squarewave(i2c_dev_t *dev);
+esp_err_t ds3231_get_oscillator_stop_flag(i2c_dev_t *dev, bool *flag);
+esp_err_t ds3231_clear_oscillator_stop_flag(i2c_dev_t *dev);
+esp_err_t ds3231_get_alarm_flags(i2c_dev_t *dev, ds3231_alarm_t *alarms);
+esp_err_t ds3231_clear_alarm_flags(i2c_dev_t *dev, ds3231_alarm_t alarms);
+esp_err_t ds3231_enable_alarm_ints(i2c_dev_t *dev, ds3231_alarm_t alarms);
+esp_err_t ds3231_disable_alarm_ints(i2c_dev_t *dev, ds3231_alarm_t alarms);
+esp_err_t ds3231_get_time_temp(i2c_dev_t *dev, struct tm *time, float *temp);
+esp_err_t ds3231_get_temp_at(i2c_dev_t *dev, time_t now, float *temp);
+esp_err_t ds3231_convert_temp(i2c_dev_t *dev);
+esp_err_t ds3231_get_temp_fresh(i2c_dev_t *dev, float *temp);
+esp_err_t ds3231_get_aging_offset(i2c_dev_t *dev, int8_t *age);
+esp_err_t ds3231_set_aging_offset(i2c_dev_t *dev, int8_t age);
+esp_err_t ds3231_flush(i2c_dev_t *dev);
+void ds3231_invalidate_cache(void);
 #endif /* MAIN_DS3231_H_ */
 
@@ -0,0 +1,448 @@
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "nvs.h"
+
+#include "ds3231_cal.h"
+#include "watch_time.h"
+
+#define TAG "DS3231_CAL"
+#define SAMPLES_KEY "samples"
+#define SYNC_KEY "sync"
+#define RATES_KEY "rates"
+
+typedef struct {
+	int64_t time;		// reference time of the measurement, s
+	int64_t offset_us;	// RTC minus reference
+} ds3231_cal_sample_t;
+
+// NVS blob, oldest sample first. Changing the aging offset changes the rate,
+// so the history is cut back to the last sample when that happens.
+typedef struct {
+	uint8_t count;
+	ds3231_cal_sample_t samples[DS3231_CAL_SAMPLES];
+} ds3231_cal_store_t;
+
+typedef struct {
+	int64_t time;		// reference time, s
+	int64_t offset_us;	// RTC minus reference, after any correction
+	float temp;			// deg Cel
+	int32_t error_us;	// of the reference, by its source
+} ds3231_cal_sync_t;
+
+// RTC rate between two syncs, the mean temperature over that time and the
+// rate error the two references leave
+typedef struct {
+	float ppm;
+	float temp;
+	float error_ppm;
+} ds3231_cal_rate_t;
+
+// NVS blob, oldest first. Unlike the drift samples these survive the RTC
+// being set; an aging change shifts them instead.
+typedef struct {
+	uint8_t count;
+	ds3231_cal_rate_t rates[DS3231_CAL_SAMPLES];
+} ds3231_cal_rates_t;
+
+// Copies of the NVS sync record and of the model fitted to the rates, so
+// only a power-on has to read flash.
+RTC_DATA_ATTR static ds3231_cal_sync_t last_sync;
+RTC_DATA_ATTR static bool last_sync_loaded;
+RTC_DATA_ATTR static ds3231_cal_model_t model;
+RTC_DATA_ATTR static bool model_loaded;
+
+// Temperatures seen since the last sync
+RTC_DATA_ATTR static struct {
+	double sum;
+	uint32_t count;
+} temps;
+
+static int64_t now_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// With the square wave locked its edges already give the RTC to the
+// microsecond. Otherwise reading the time only gives whole seconds, and
+// polling the seconds register until it rolls over places the RTC's second
+// boundary between two reads, to within about half the poll period. The
+// task sleeps between the polls, which can take up to a second.
+esp_err_t ds3231_cal_measure(i2c_dev_t *dev, int64_t *offset_us)
+{
+	if (!dev || !offset_us) return ESP_ERR_INVALID_ARG;
+
+	int64_t ref = now_us();
+	int64_t rtc_us = watch_time_now_us();
+	if (rtc_us >= 0)
+	{
+		*offset_us = rtc_us - ref;
+		return ESP_OK;
+	}
+
+	uint8_t first, sec;
+	esp_err_t res = i2c_dev_read_reg(dev, DS3231_ADDR_TIME, &first, 1);
+	if (res != ESP_OK) return res;
+
+	int64_t prev = now_us();
+	int64_t deadline = esp_timer_get_time() + 1100000;
+	TickType_t poll = pdMS_TO_TICKS(DS3231_CAL_POLL_MS);
+	int64_t edge;
+	while (1) {
+		vTaskDelay(poll ? poll : 1);
+		res = i2c_dev_read_reg(dev, DS3231_ADDR_TIME, &sec, 1);
+		if (res != ESP_OK) return res;
+		int64_t t = now_us();
+		if (sec != first)
+		{
+			edge = (prev + t) / 2;
+			break;
+		}
+		if (esp_timer_get_time() > deadline) return ESP_ERR_TIMEOUT;
+		prev = t;
+	}
+
+	time_t rtc;
+	res = ds3231_get_epoch(dev, &rtc);
+	if (res != ESP_OK) return res;
+
+	// the RTC second 'rtc' started at 'edge' on the reference clock
+	*offset_us = (int64_t)rtc * 1000000 - edge;
+	return ESP_OK;
+}
+
+static esp_err_t load_rates(nvs_handle_t nvs, ds3231_cal_rates_t *store)
+{
+	size_t size = sizeof(*store);
+	esp_err_t res = nvs_get_blob(nvs, RATES_KEY, store, &size);
+	if (res == ESP_ERR_NVS_NOT_FOUND || (res == ESP_OK && (size != sizeof(*store) || store->count > DS3231_CAL_SAMPLES)))
+	{
+		memset(store, 0, sizeof(*store));
+		return ESP_OK;
+	}
+	return res;
+}
+
+static esp_err_t load(nvs_handle_t nvs, ds3231_cal_store_t *store)
+{
+	size_t size = sizeof(*store);
+	esp_err_t res = nvs_get_blob(nvs, SAMPLES_KEY, store, &size);
+	if (res == ESP_ERR_NVS_NOT_FOUND || (res == ESP_OK && (size != sizeof(*store) || store->count > DS3231_CAL_SAMPLES)))
+	{
+		memset(store, 0, sizeof(*store));
+		return ESP_OK;
+	}
+	return res;
+}
+
+// Least-squares slope of offset over time, in us/s = ppm. Times are taken
+// relative to the first sample to keep the sums well inside a double.
+static float fit_ppm(const ds3231_cal_store_t *store)
+{
+	const ds3231_cal_sample_t *s = store->samples;
+	double mt = 0, mo = 0;
+	for (int i = 0; i < store->count; i++)
+	{
+		mt += s[i].time - s[0].time;
+		mo += s[i].offset_us - s[0].offset_us;
+	}
+	mt /= store->count;
+	mo /= store->count;
+
+	double stt = 0, sto = 0;
+	for (int i = 0; i < store->count; i++)
+	{
+		double dt = s[i].time - s[0].time - mt;
+		stt += dt * dt;
+		sto += dt * (s[i].offset_us - s[0].offset_us - mo);
+	}
+	return stt > 0 ? sto / stt : 0;
+}
+
+esp_err_t ds3231_cal_update(i2c_dev_t *dev, time_t now, int64_t offset_us, ds3231_cal_source_t source,
+	ds3231_cal_result_t *result)
+{
+	if (!dev || !result) return ESP_ERR_INVALID_ARG;
+	memset(result, 0, sizeof(*result));
+
+	// +-100 ms over DS3231_CAL_MIN_SPAN_S alone is about 10 LSB of mis-trim
+	if (source != DS3231_CAL_SOURCE_NTP) return ds3231_get_aging_offset(dev, &result->aging);
+
+	nvs_handle_t nvs;
+	esp_err_t res = nvs_open(DS3231_CAL_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+	if (res != ESP_OK) return res;
+
+	ds3231_cal_store_t store;
+	res = load(nvs, &store);
+	if (res != ESP_OK) goto out;
+
+	if (store.count == DS3231_CAL_SAMPLES)
+	{
+		memmove(&store.samples[0], &store.samples[1], sizeof(store.samples[0]) * (DS3231_CAL_SAMPLES - 1));
+		store.count--;
+	}
+	store.samples[store.count++] = (ds3231_cal_sample_t){ .time = now, .offset_us = offset_us };
+
+	res = ds3231_get_aging_offset(dev, &result->aging);
+	if (res != ESP_OK) goto out;
+
+	result->samples = store.count;
+	result->fitted = store.count >= DS3231_CAL_MIN_SAMPLES
+		&& store.samples[store.count - 1].time - store.samples[0].time >= DS3231_CAL_MIN_SPAN_S;
+	if (result->fitted)
+	{
+		result->ppm = fit_ppm(&store);
+		// a positive offset slows the oscillator down
+		int aging = result->aging + lroundf(result->ppm / DS3231_CAL_PPM_PER_LSB);
+		if (aging < INT8_MIN) aging = INT8_MIN;
+		if (aging > INT8_MAX) aging = INT8_MAX;
+		if (aging != result->aging)
+		{
+			res = ds3231_set_aging_offset(dev, aging);
+			if (res != ESP_OK) goto out;
+			ESP_LOGI(TAG, "%.2f ppm over %d samples, aging offset %d -> %d",
+				result->ppm, store.count, result->aging, aging);
+			// the rates measured so far drop by the trim, and so does the model
+			ds3231_cal_rates_t rates;
+			res = load_rates(nvs, &rates);
+			if (res != ESP_OK) goto out;
+			for (int i = 0; i < rates.count; i++) rates.rates[i].ppm -= (aging - result->aging) * DS3231_CAL_PPM_PER_LSB;
+			res = nvs_set_blob(nvs, RATES_KEY, &rates, sizeof(rates));
+			if (res != ESP_OK) goto out;
+			model_loaded = false;
+
+			result->aging = aging;
+			result->trimmed = true;
+			store.samples[0] = store.samples[store.count - 1];
+			store.count = 1;
+		}
+	}
+
+	res = nvs_set_blob(nvs, SAMPLES_KEY, &store, sizeof(store));
+	if (res == ESP_OK) res = nvs_commit(nvs);
+out:
+	nvs_close(nvs);
+	return res;
+}
+
+// Forgets the stored samples. Needed whenever the RTC is set, since that
+// makes the offset jump.
+esp_err_t ds3231_cal_reset(void)
+{
+	nvs_handle_t nvs;
+	esp_err_t res = nvs_open(DS3231_CAL_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+	if (res != ESP_OK) return res;
+
+	res = nvs_erase_key(nvs, SAMPLES_KEY);
+	if (res == ESP_ERR_NVS_NOT_FOUND) res = ESP_OK;
+	if (res == ESP_OK) res = nvs_commit(nvs);
+	nvs_close(nvs);
+	return res;
+}
+
+// Weight of a rate: the inverse of its variance, the reference error on top
+// of the model's floor.
+static double rate_weight(const ds3231_cal_rate_t *r)
+{
+	return 1.0 / (DS3231_CAL_SIGMA_MIN_PPM * DS3231_CAL_SIGMA_MIN_PPM + r->error_ppm * r->error_ppm);
+}
+
+// Weighted least squares of ppm = a + b * (temp - turnover)^2, the shape of
+// a tuning fork crystal's drift that the DS3231's compensation leaves a
+// residue of. Without a spread of temperatures b stays 0 and a is the mean
+// rate.
+static void fit_model(const ds3231_cal_rates_t *store, ds3231_cal_model_t *m)
+{
+	memset(m, 0, sizeof(*m));
+	m->samples = store->count;
+	if (store->count < DS3231_CAL_MIN_SAMPLES) return;
+
+	double sw = 0, mx = 0, my = 0;
+	for (int i = 0; i < store->count; i++)
+	{
+		double w = rate_weight(&store->rates[i]);
+		double d = store->rates[i].temp - DS3231_CAL_TURNOVER_C;
+		sw += w;
+		mx += w * d * d;
+		my += w * store->rates[i].ppm;
+	}
+	mx /= sw;
+	my /= sw;
+
+	// sxx in the units of an unweighted sum, so the spread test still holds
+	double sxx = 0, sxy = 0;
+	for (int i = 0; i < store->count; i++)
+	{
+		double w = rate_weight(&store->rates[i]) * store->count / sw;
+		double d = store->rates[i].temp - DS3231_CAL_TURNOVER_C;
+		sxx += w * (d * d - mx) * (d * d - mx);
+		sxy += w * (d * d - mx) * (store->rates[i].ppm - my);
+	}
+	double b = sxx > 1.0 ? sxy / sxx : 0;
+	double a = my - b * mx;
+
+	double ssr = 0;
+	for (int i = 0; i < store->count; i++)
+	{
+		double w = rate_weight(&store->rates[i]) * store->count / sw;
+		double d = store->rates[i].temp - DS3231_CAL_TURNOVER_C;
+		double e = store->rates[i].ppm - (a + b * d * d);
+		ssr += w * e * e;
+	}
+	float sigma = sqrt(ssr / (store->count - 2 + (b == 0)));
+
+	m->fitted = true;
+	m->ppm = a;
+	m->ppm_per_c2 = b;
+	m->sigma_ppm = sigma > DS3231_CAL_SIGMA_MIN_PPM ? sigma : DS3231_CAL_SIGMA_MIN_PPM;
+}
+
+static esp_err_t load_sync(void)
+{
+	if (last_sync_loaded && model_loaded) return ESP_OK;
+
+	nvs_handle_t nvs;
+	esp_err_t res = nvs_open(DS3231_CAL_NVS_NAMESPACE, NVS_READONLY, &nvs);
+	if (res != ESP_OK) return res == ESP_ERR_NVS_NOT_FOUND ? ESP_ERR_NOT_FOUND : res;
+
+	size_t size = sizeof(last_sync);
+	res = nvs_get_blob(nvs, SYNC_KEY, &last_sync, &size);
+	if (res == ESP_ERR_NVS_NOT_FOUND || (res == ESP_OK && size != sizeof(last_sync))) res = ESP_ERR_NOT_FOUND;
+
+	ds3231_cal_rates_t rates;
+	if (res == ESP_OK) res = load_rates(nvs, &rates);
+	nvs_close(nvs);
+	if (res != ESP_OK) return res;
+
+	fit_model(&rates, &model);
+	last_sync_loaded = model_loaded = true;
+	return ESP_OK;
+}
+
+void ds3231_cal_note_temp(float temp)
+{
+	temps.sum += temp;
+	temps.count++;
+}
+
+// Mean temperature since the last sync, its reading included
+static float mean_temp(void)
+{
+	return (temps.sum + last_sync.temp) / (temps.count + 1);
+}
+
+// A sync long enough after the previous one adds the rate between them,
+// against the mean temperature over that time, and refits the model.
+static int32_t source_error_us(ds3231_cal_source_t source)
+{
+	return source == DS3231_CAL_SOURCE_NTP ? DS3231_CAL_NTP_ERROR_US : DS3231_CAL_PHONE_ERROR_US;
+}
+
+esp_err_t ds3231_cal_record_sync(time_t now, int64_t offset_us, float temp, bool set, ds3231_cal_source_t source)
+{
+	esp_err_t res = load_sync();
+	bool first = res == ESP_ERR_NOT_FOUND;
+	if (res != ESP_OK && !first) return res;
+
+	nvs_handle_t nvs;
+	res = nvs_open(DS3231_CAL_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+	if (res != ESP_OK) return res;
+
+	int32_t error_us = source_error_us(source);
+	int64_t span = now - last_sync.time;
+	if (!first && !set && span >= DS3231_CAL_RATE_MIN_SPAN_S)
+	{
+		ds3231_cal_rates_t rates;
+		res = load_rates(nvs, &rates);
+		if (res != ESP_OK) goto out;
+		if (rates.count == DS3231_CAL_SAMPLES)
+		{
+			memmove(&rates.rates[0], &rates.rates[1], sizeof(rates.rates[0]) * (DS3231_CAL_SAMPLES - 1));
+			rates.count--;
+		}
+		rates.rates[rates.count++] = (ds3231_cal_rate_t){
+			.ppm = (float)(offset_us - last_sync.offset_us) / span,
+			.temp = (temps.sum + last_sync.temp + temp) / (temps.count + 2),
+			.error_ppm = (float)(last_sync.error_us + error_us) / span,
+		};
+		res = nvs_set_blob(nvs, RATES_KEY, &rates, sizeof(rates));
+		if (res != ESP_OK) goto out;
+		fit_model(&rates, &model);
+		model_loaded = true;
+	}
+
+	ds3231_cal_sync_t sync = { .time = now, .offset_us = offset_us, .temp = temp, .error_us = error_us };
+	res = nvs_set_blob(nvs, SYNC_KEY, &sync, sizeof(sync));
+	if (res == ESP_OK) res = nvs_commit(nvs);
+	if (res != ESP_OK) goto out;
+
+	last_sync = sync;
+	last_sync_loaded = true;
+	temps.sum = 0;
+	temps.count = 0;
+out:
+	nvs_close(nvs);
+	return res;
+}
+
+// Rate expected at the mean temperature since the last sync and its
+// uncertainty. Without a model the rate is unknown within the datasheet's
+// worst case.
+static void predict_rate(float *ppm, float *error_ppm)
+{
+	if (!model.fitted)
+	{
+		*ppm = 0;
+		*error_ppm = DS3231_CAL_DRIFT_PPM;
+		return;
+	}
+	float d = mean_temp() - DS3231_CAL_TURNOVER_C;
+	*ppm = model.ppm + model.ppm_per_c2 * d * d;
+	*error_ppm = DS3231_CAL_SIGMA_K * model.sigma_ppm;
+}
+
+// The offset at the last sync carried forward at the predicted rate, plus
+// the rate's uncertainty over the time since and the reference's own error.
+// A clock that went backwards counts as elapsed time too.
+esp_err_t ds3231_cal_predict_error(time_t now, int64_t *error_us)
+{
+	if (!error_us) return ESP_ERR_INVALID_ARG;
+
+	esp_err_t res = load_sync();
+	if (res != ESP_OK) return res;
+
+	float ppm, error_ppm;
+	predict_rate(&ppm, &error_ppm);
+	int64_t elapsed = now - last_sync.time;
+	int64_t drift = last_sync.offset_us + (int64_t)(elapsed * ppm);
+	if (elapsed < 0) elapsed = -elapsed;
+	*error_us = llabs(drift) + (int64_t)(elapsed * error_ppm) + last_sync.error_us;
+	return ESP_OK;
+}
+
+// When ds3231_cal_predict_error() reaches 'tolerance_us', bounding it by a
+// straight line so the answer is closed form. Past already if the last
+// sync left more than that.
+esp_err_t ds3231_cal_next_sync(int64_t tolerance_us, time_t *next, ds3231_cal_model_t *m)
+{
+	if (!next) return ESP_ERR_INVALID_ARG;
+
+	esp_err_t res = load_sync();
+	if (res != ESP_OK) return res;
+
+	float ppm, error_ppm;
+	predict_rate(&ppm, &error_ppm);
+	int64_t margin = tolerance_us - llabs(last_sync.offset_us) - last_sync.error_us;
+	*next = last_sync.time + (margin > 0 ? (time_t)(margin / (fabsf(ppm) + error_ppm)) : 0);
+	if (m) *m = model;
+	return ESP_OK;
+}
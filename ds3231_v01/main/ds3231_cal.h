@@ -0,0 +1,74 @@
+#ifndef MAIN_DS3231_CAL_H_
+#define MAIN_DS3231_CAL_H_
+
+#include <time.h>
+#include <stdbool.h>
+
+#include "ds3231.h"
+
+#define DS3231_CAL_SAMPLES 16			// drift samples kept in NVS
+#define DS3231_CAL_MIN_SAMPLES 3		// samples needed before the aging register is touched
+#define DS3231_CAL_MIN_SPAN_S 86400		// and the time they must span
+#define DS3231_CAL_PPM_PER_LSB 0.1f		// aging trim at 25 deg Cel
+#define DS3231_CAL_POLL_MS 10			// seconds register poll period without the square wave
+#define DS3231_CAL_DRIFT_PPM 2.0f		// worst-case RTC rate error, 0 to 40 deg Cel
+#define DS3231_CAL_RATE_MIN_SPAN_S (6*60*60)	// shortest time between syncs that gives a rate
+#define DS3231_CAL_TURNOVER_C 25.0f		// crystal turnover temperature of the drift model
+#define DS3231_CAL_SIGMA_MIN_PPM 0.05f	// floor of the fitted rate uncertainty
+#define DS3231_CAL_SIGMA_K 3.0f			// prediction bound in standard deviations
+#define DS3231_CAL_NTP_ERROR_US 10000		// reference error of an NTP sync
+#define DS3231_CAL_PHONE_ERROR_US 100000	// and of a phone's wall clock over BLE
+#define DS3231_CAL_NVS_NAMESPACE "ds3231cal"
+
+// Where the reference time came from, which sets how far it is trusted
+typedef enum {
+	DS3231_CAL_SOURCE_NTP,
+	DS3231_CAL_SOURCE_PHONE,
+} ds3231_cal_source_t;
+
+typedef struct {
+	uint8_t samples;	// samples in the fit
+	bool fitted;		// enough samples and span for ppm to be meaningful
+	float ppm;			// RTC rate error, positive if it runs fast
+	int8_t aging;		// aging offset in effect after the update
+	bool trimmed;		// aging was changed by this update
+} ds3231_cal_result_t;
+
+typedef struct {
+	uint8_t samples;	// rates in the fit
+	bool fitted;		// enough rates for the model to be used
+	float ppm;			// RTC rate at DS3231_CAL_TURNOVER_C, positive if it runs fast
+	float ppm_per_c2;	// change per squared degree away from it
+	float sigma_ppm;	// standard deviation of the rates around the model
+} ds3231_cal_model_t;
+
+// Aging-offset calibration against a trusted clock such as NTP.
+// ds3231_cal_measure() times the RTC against the system clock, from the
+// square wave when watch_time is locked and by polling for the next second
+// boundary otherwise; ds3231_cal_update() stores the offset in NVS, fits the drift
+// over all stored samples and trims the oscillator once the fit is good.
+// Only NTP samples are fitted; a phone's clock is too coarse for a trim, so
+// its samples just report the aging offset. The RTC keeps UTC. NVS must be
+// initialised.
+esp_err_t ds3231_cal_measure(i2c_dev_t *dev, int64_t *offset_us);
+esp_err_t ds3231_cal_update(i2c_dev_t *dev, time_t now, int64_t offset_us, ds3231_cal_source_t source,
+	ds3231_cal_result_t *result);
+esp_err_t ds3231_cal_reset(void);
+
+// Drift model for scheduling syncs. Each time the RTC is compared with, or
+// set from, the trusted clock, ds3231_cal_record_sync() stores its offset
+// and the temperature, and the rate since the previous sync joins a fit of
+// the rate against temperature. ds3231_cal_note_temp() adds the readings in
+// between to the mean temperature of the next rate. 'set' marks the RTC as
+// just set, which starts a new rate instead of ending one. Each rate is
+// weighted by the error 'source' leaves in it over its span, so phone syncs
+// count for little until they are far apart.
+// ds3231_cal_predict_error() bounds the RTC error at 'now' from the last
+// sync and the model, ds3231_cal_next_sync() gives the time that bound
+// reaches 'tolerance_us'. Both return ESP_ERR_NOT_FOUND if there was no
+// sync yet. Times are UTC.
+esp_err_t ds3231_cal_record_sync(time_t now, int64_t offset_us, float temp, bool set, ds3231_cal_source_t source);
+void ds3231_cal_note_temp(float temp);
+esp_err_t ds3231_cal_predict_error(time_t now, int64_t *error_us);
+esp_err_t ds3231_cal_next_sync(int64_t tolerance_us, time_t *next, ds3231_cal_model_t *model);
+#endif /* MAIN_DS3231_CAL_H_ */
@@ -0,0 +1,247 @@
+#include <string.h>
+#include <math.h>
+
+#include "ds3231.h"
+#include "ds3231_sim.h"
+
+#define DS3231_CTRL_DEFAULT 0x1c	// INTCN, RS2, RS1 after power-on
+
+static uint8_t days_in_month(int month, int year)
+{
+	static const uint8_t days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	if (month == 2 && year % 4 == 0) return 29;
+	return days[month - 1];
+}
+
+static void latch_temp(ds3231_sim_t *sim)
+{
+	unsigned raw = (unsigned)lroundf(sim->temp * 4) & 0x3ff;
+	sim->regs[DS3231_ADDR_TEMP] = raw >> 2;
+	sim->regs[DS3231_ADDR_TEMP + 1] = (raw & 0x03) << 6;
+}
+
+static void next_day(uint8_t *r)
+{
+	r[3] = r[3] % 7 + 1;
+
+	int date = bcd2dec(r[4]) + 1;
+	int month = bcd2dec(r[5] & DS3231_MONTH_MASK);
+	int year = bcd2dec(r[6]);
+	if (date <= days_in_month(month, year))
+	{
+		r[4] = dec2bcd(date);
+		return;
+	}
+	r[4] = 0x01;
+	if (++month <= 12)
+	{
+		r[5] = (r[5] & 0x80) | dec2bcd(month);
+		return;
+	}
+	r[5] = (r[5] & 0x80) | 0x01;
+	if (++year <= 99)
+	{
+		r[6] = dec2bcd(year);
+		return;
+	}
+	r[6] = 0x00;
+	r[5] ^= 0x80;	/* century */
+}
+
+static void next_hour(uint8_t *r)
+{
+	if (r[2] & DS3231_12HOUR_FLAG)
+	{
+		int hour = bcd2dec(r[2] & DS3231_12HOUR_MASK);
+		uint8_t mode = r[2] & (DS3231_12HOUR_FLAG | DS3231_PM_FLAG);
+		if (hour == 11)
+		{
+			/* 11 PM -> 12 AM starts a new day */
+			mode ^= DS3231_PM_FLAG;
+			r[2] = mode | dec2bcd(12);
+			if (!(mode & DS3231_PM_FLAG)) next_day(r);
+			return;
+		}
+		r[2] = mode | dec2bcd(hour == 12 ? 1 : hour + 1);
+		return;
+	}
+
+	int hour = bcd2dec(r[2] & 0x3f) + 1;
+	if (hour < 24)
+	{
+		r[2] = dec2bcd(hour);
+		return;
+	}
+	r[2] = 0x00;
+	next_day(r);
+}
+
+/* A field matches when its mask bit (bit 7) is set or its value is equal. */
+static bool field_match(uint8_t alarm, uint8_t value, uint8_t mask)
+{
+	return (alarm & DS3231_ALARM_NOTSET) || (alarm & mask) == (value & mask);
+}
+
+static bool day_match(uint8_t alarm, const uint8_t *r)
+{
+	if (alarm & DS3231_ALARM_NOTSET) return true;
+	if (alarm & DS3231_ALARM_WDAY) return (alarm & 0x0f) == r[3];
+	return (alarm & 0x3f) == r[4];
+}
+
+static void check_alarms(ds3231_sim_t *sim)
+{
+	uint8_t *r = sim->regs;
+	const uint8_t *a1 = &r[DS3231_ADDR_ALARM1];
+	const uint8_t *a2 = &r[DS3231_ADDR_ALARM2];
+
+	if (field_match(a1[0], r[0], 0x7f) && field_match(a1[1], r[1], 0x7f)
+		&& field_match(a1[2], r[2], 0x7f) && day_match(a1[3], r))
+		r[DS3231_ADDR_STATUS] |= DS3231_STAT_ALARM_1;
+
+	if (r[0] == 0 && field_match(a2[0], r[1], 0x7f)
+		&& field_match(a2[1], r[2], 0x7f) && day_match(a2[2], r))
+		r[DS3231_ADDR_STATUS] |= DS3231_STAT_ALARM_2;
+}
+
+static void tick(ds3231_sim_t *sim)
+{
+	uint8_t *r = sim->regs;
+
+	int sec = bcd2dec(r[0]) + 1;
+	if (sec < 60) r[0] = dec2bcd(sec);
+	else
+	{
+		r[0] = 0x00;
+		int min = bcd2dec(r[1]) + 1;
+		if (min < 60) r[1] = dec2bcd(min);
+		else
+		{
+			r[1] = 0x00;
+			next_hour(r);
+		}
+	}
+	check_alarms(sim);
+}
+
+static void start_conversion(ds3231_sim_t *sim, int64_t at)
+{
+	if (!sim->conv_done_us) sim->conv_done_us = at + DS3231_SIM_CONV_US;
+}
+
+static void advance(ds3231_sim_t *sim, int64_t now)
+{
+	int64_t elapsed = now - sim->last_us;
+	if (elapsed <= 0) return;
+	sim->last_us = now;
+
+	/* conversion events in time order */
+	while (1) {
+		if (sim->conv_done_us && sim->conv_done_us <= sim->next_tcxo_us && sim->conv_done_us <= now)
+		{
+			latch_temp(sim);
+			sim->regs[DS3231_ADDR_CONTROL] &= ~DS3231_CTRL_TEMPCONV;
+			sim->conv_done_us = 0;
+		}
+		else if (sim->next_tcxo_us <= now)
+		{
+			start_conversion(sim, sim->next_tcxo_us);
+			sim->next_tcxo_us += DS3231_SIM_TCXO_US;
+		}
+		else break;
+	}
+
+	double ppm = sim->drift_ppm - 0.1 * (int8_t)sim->regs[DS3231_ADDR_AGING];
+	sim->frac_us += elapsed * (1.0 + ppm * 1e-6);
+	while (sim->frac_us >= 1000000) {
+		sim->frac_us -= 1000000;
+		tick(sim);
+	}
+}
+
+static void write_reg(ds3231_sim_t *sim, uint8_t reg, uint8_t val, int64_t now)
+{
+	uint8_t *r = sim->regs;
+
+	switch (reg) {
+	case DS3231_ADDR_TIME:
+		/* writing seconds resets the countdown chain */
+		sim->frac_us = 0;
+		r[reg] = val;
+		break;
+	case DS3231_ADDR_CONTROL:
+		r[reg] = val;
+		if (val & DS3231_CTRL_TEMPCONV) start_conversion(sim, now);
+		break;
+	case DS3231_ADDR_STATUS:
+		/* OSF and the alarm flags can only be cleared, BSY is read-only */
+		r[reg] = (r[reg] & val & (DS3231_STAT_OSCILLATOR | DS3231_STAT_ALARM_2 | DS3231_STAT_ALARM_1))
+			| (val & DS3231_STAT_32KHZ);
+		break;
+	case DS3231_ADDR_TEMP:
+	case DS3231_ADDR_TEMP + 1:
+		break;
+	default:
+		r[reg] = val;
+		break;
+	}
+}
+
+static esp_err_t sim_write(i2c_sim_device_t *base, const uint8_t *data, size_t size, int64_t now)
+{
+	ds3231_sim_t *sim = (ds3231_sim_t *)base;
+
+	advance(sim, now);
+	if (data[0] >= DS3231_SIM_REGS) return ESP_ERR_INVALID_ARG;
+	sim->ptr = data[0];
+	for (size_t i = 1; i < size; i++)
+	{
+		write_reg(sim, sim->ptr, data[i], now);
+		sim->ptr = (sim->ptr + 1) % DS3231_SIM_REGS;
+	}
+	return ESP_OK;
+}
+
+static esp_err_t sim_read(i2c_sim_device_t *base, uint8_t *data, size_t size, int64_t now)
+{
+	ds3231_sim_t *sim = (ds3231_sim_t *)base;
+
+	advance(sim, now);
+	for (size_t i = 0; i < size; i++)
+	{
+		data[i] = sim->regs[sim->ptr];
+		if (sim->ptr == DS3231_ADDR_STATUS && sim->conv_done_us) data[i] |= DS3231_STAT_BUSY;
+		sim->ptr = (sim->ptr + 1) % DS3231_SIM_REGS;
+	}
+	return ESP_OK;
+}
+
+/* time->tm_year is the full year, as for ds3231_set_time() */
+void ds3231_sim_init(ds3231_sim_t *sim, const struct tm *time)
+{
+	memset(sim, 0, sizeof(*sim));
+	sim->base.addr = DS3231_ADDR;
+	sim->base.write = sim_write;
+	sim->base.read = sim_read;
+
+	uint8_t *r = sim->regs;
+	r[0] = dec2bcd(time->tm_sec);
+	r[1] = dec2bcd(time->tm_min);
+	r[2] = dec2bcd(time->tm_hour);
+	r[3] = dec2bcd(time->tm_wday + 1);
+	r[4] = dec2bcd(time->tm_mday);
+	r[5] = dec2bcd(time->tm_mon + 1);
+	r[6] = dec2bcd(time->tm_year - 2000);
+	r[DS3231_ADDR_CONTROL] = DS3231_CTRL_DEFAULT;
+	r[DS3231_ADDR_STATUS] = DS3231_STAT_OSCILLATOR | DS3231_STAT_32KHZ;
+
+	sim->temp = 25.0;
+	latch_temp(sim);
+	sim->last_us = i2c_sim_now_us();
+	sim->next_tcxo_us = sim->last_us + DS3231_SIM_TCXO_US;
+}
+
+void ds3231_sim_set_temp(ds3231_sim_t *sim, float temp)
+{
+	sim->temp = temp;
+}
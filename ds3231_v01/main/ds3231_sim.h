@@ -0,0 +1,30 @@
+#ifndef MAIN_DS3231_SIM_H_
+#define MAIN_DS3231_SIM_H_
+
+#include <time.h>
+
+#include "i2cdev_sim.h"
+
+#define DS3231_SIM_REGS      0x13
+#define DS3231_SIM_CONV_US   200000		// temperature conversion time
+#define DS3231_SIM_TCXO_US   64000000	// automatic conversion period
+
+// Register-file model of the DS3231: BCD time keeping with calendar and
+// century roll-over, both alarms with every match mode, control/status
+// semantics (write-0-to-clear flags, BSY, CONV) and an oscillator whose
+// rate follows drift_ppm and the aging offset (about 0.1 ppm per LSB).
+typedef struct {
+	i2c_sim_device_t base;
+	uint8_t regs[DS3231_SIM_REGS];
+	uint8_t ptr;			// register pointer, auto-increments and wraps
+	int64_t last_us;		// virtual time the model was last advanced to
+	double frac_us;			// progress into the current RTC second
+	int64_t next_tcxo_us;	// next automatic temperature conversion
+	int64_t conv_done_us;	// end of the conversion in progress, 0 if idle
+	float temp;				// ambient temperature seen by the sensor
+	float drift_ppm;		// crystal error before the aging trim
+} ds3231_sim_t;
+
+void ds3231_sim_init(ds3231_sim_t *sim, const struct tm *time);
+void ds3231_sim_set_temp(ds3231_sim_t *sim, float temp);
+#endif /* MAIN_DS3231_SIM_H_ */
@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <time.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include "ds3231.h"
+#include "ds3231_sim.h"
+#include "tz.h"
+#include "i2cdev_stats.h"
+#include "i2cdev_log.h"
+
+// Host build entry point: runs the DS3231 driver against the register-map
+// emulator and reports the modelled bus time per call at I2C_FREQ_HZ.
+
+#define BENCH_ITERATIONS 1000
+
+static const char *TAG = "DS3213";
+
+static ds3231_sim_t rtc;
+
+static void report(const char *name, int calls, int64_t wall_us)
+{
+	i2c_sim_stats_t stats;
+	i2c_sim_get_stats(&stats);
+	ESP_LOGI(TAG, "%-24s %6"PRIu64" us bus, %4"PRIu32" transactions, %6"PRIu64" bytes, %6"PRId64" us host per %d calls",
+		name, stats.bus_time_us, stats.transactions, stats.bytes, wall_us, calls);
+	i2c_sim_reset_stats();
+}
+
+static int64_t host_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Scalar reference of ds3231_bcd_unpack(): field masks, then bcd2dec().
+static bool bcd_unpack_scalar(const uint8_t *regs, uint8_t *dec)
+{
+	static const uint8_t masks[7] = { 0x7f, 0x7f, 0x3f, 0x07, 0x3f, DS3231_MONTH_MASK, 0xff };
+	bool valid = true;
+	for (int i = 0; i < 7; i++)
+	{
+		uint8_t v = regs[i] & masks[i];
+		if (i == 2 && (regs[2] & DS3231_12HOUR_FLAG)) v = regs[2] & DS3231_12HOUR_MASK;
+		if ((v & 0x0f) > 9 || v >> 4 > 9) valid = false;
+		dec[i] = bcd2dec(v);
+	}
+	return valid;
+}
+
+// Every byte value in every register, against the reference, and every
+// field value 0-99 through ds3231_bcd_pack() against dec2bcd().
+static bool checkBcd(void)
+{
+	for (int lane = 0; lane < 7; lane++)
+	{
+		for (int v = 0; v < 256; v++)
+		{
+			uint8_t regs[7] = { 0x59, 0x59, 0x23, 0x07, 0x31, 0x12, 0x99 };
+			uint8_t got[7], want[7];
+			regs[lane] = v;
+			bool valid = ds3231_bcd_unpack(regs, got);
+			if (valid != bcd_unpack_scalar(regs, want) || memcmp(got, want, 7)) {
+				ESP_LOGE(TAG, "ds3231_bcd_unpack mismatch, register %d = 0x%02x", lane, v);
+				return false;
+			}
+		}
+	}
+	for (int v = 0; v < 100; v++)
+	{
+		uint8_t dec[7], regs[7];
+		for (int i = 0; i < 7; i++) dec[i] = (v + 13 * i) % 100;
+		ds3231_bcd_pack(dec, regs);
+		for (int i = 0; i < 7; i++)
+		{
+			if (regs[i] != dec2bcd(dec[i])) {
+				ESP_LOGE(TAG, "ds3231_bcd_pack mismatch, field %d = %d", i, dec[i]);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// POSIX TZ strings of some zones in tz_zones.c, for newlib/glibc to check against
+static const struct {
+	const char *name;
+	const char *posix;
+} tz_checks[] = {
+	{ "UTC", "UTC0" },
+	{ "Europe/London", "GMT0BST,M3.5.0/1,M10.5.0" },
+	{ "Europe/Brussels", "CET-1CEST,M3.5.0,M10.5.0/3" },
+	{ "Europe/Helsinki", "EET-2EEST,M3.5.0/3,M10.5.0/4" },
+	{ "Asia/Kolkata", "IST-5:30" },
+	{ "Australia/Adelaide", "ACST-9:30ACDT,M10.1.0,M4.1.0/3" },
+	{ "Australia/Sydney", "AEST-10AEDT,M10.1.0,M4.1.0/3" },
+	{ "Pacific/Auckland", "NZST-12NZDT,M9.5.0,M4.1.0/3" },
+	{ "America/New_York", "EST5EDT,M3.2.0,M11.1.0" },
+	{ "America/Los_Angeles", "PST8PDT,M3.2.0,M11.1.0" },
+};
+
+static bool same_tm(const struct tm *a, const struct tm *b)
+{
+	return a->tm_sec == b->tm_sec && a->tm_min == b->tm_min && a->tm_hour == b->tm_hour
+		&& a->tm_mday == b->tm_mday && a->tm_mon == b->tm_mon && a->tm_year == b->tm_year
+		&& a->tm_wday == b->tm_wday && a->tm_yday == b->tm_yday && a->tm_isdst == b->tm_isdst;
+}
+
+// tz_localtime() against localtime_r() over the DS3231's range, once an hour
+// and a bit so every time of day comes up, and on both sides of every
+// transition. tz_utc() has to give back a UTC time with the same local time,
+// which in the hour a DST end repeats may be the other one.
+static bool checkTz(void)
+{
+	bool ok = true;
+	for (int i = 0; i < sizeof(tz_checks) / sizeof(tz_checks[0]) && ok; i++)
+	{
+		tz_t tz;
+		tz_init(&tz, tz_find(tz_checks[i].name), 0);
+		setenv("TZ", tz_checks[i].posix, 1);
+		tzset();
+		time_t edge = TZ_TIME_MAX;
+		for (time_t t = DS3231_EPOCH_MIN; t <= DS3231_EPOCH_MAX && ok; t += 3607)
+		{
+			struct tm want, got;
+			for (time_t u = edge - 1; t >= edge && u <= edge; u++)
+			{
+				localtime_r(&u, &want);
+				tz_localtime(&tz, u, &got);
+				if (!same_tm(&want, &got)) ok = false;
+			}
+			localtime_r(&t, &want);
+			tz_localtime(&tz, t, &got);
+			if (!same_tm(&want, &got)) ok = false;
+			edge = tz.until;
+			time_t local = tz_local(&tz, t);
+			if (tz_local(&tz, tz_utc(&tz, local)) != local) ok = false;
+			if (!ok) ESP_LOGE(TAG, "%s mismatch at %lld", tz_checks[i].name, (long long)t);
+		}
+	}
+	unsetenv("TZ");
+	tzset();
+	return ok;
+}
+
+void benchClock(void *pvParameters)
+{
+	if (!checkBcd() || !checkTz()) exit(1);
+
+	struct tm start = {
+		.tm_year = 2025,
+		.tm_mon  = 0,  // 0-based
+		.tm_mday = 1,
+		.tm_wday = 3,
+	};
+	ds3231_sim_init(&rtc, &start);
+	i2c_sim_attach(&rtc.base);
+
+	i2c_dev_t dev;
+	if (ds3231_init_desc(&dev, I2C_NUM_0, 0, 0) != ESP_OK) {
+		ESP_LOGE(pcTaskGetName(0), "Could not init device descriptor.");
+		exit(1);
+	}
+
+	struct tm rtcinfo;
+	float temp;
+	int64_t t0;
+	i2c_sim_stats_t stats;
+
+	// A second descriptor of the same device shares the first one's handle
+	// and clock and costs no bus traffic.
+	i2c_dev_t dev2;
+	i2c_sim_reset_stats();
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS; i++)
+	{
+		ds3231_init_desc(&dev2, I2C_NUM_0, 0, 0);
+		ds3231_free_desc(&dev2);
+	}
+	report("ds3231_init/free_desc", BENCH_ITERATIONS, host_now_us() - t0);
+
+	i2c_sim_reset_stats();
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS; i++) ds3231_get_time(&dev, &rtcinfo);
+	report("ds3231_get_time", BENCH_ITERATIONS, host_now_us() - t0);
+
+	// Seconds since the epoch: struct tm and mktime() against the direct
+	// BCD conversion, with the bus and then with the conversion alone.
+	time_t epoch;
+	volatile time_t sink;
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS; i++)
+	{
+		ds3231_get_time(&dev, &rtcinfo);
+		rtcinfo.tm_year -= 1900;
+		rtcinfo.tm_isdst = -1;
+		epoch = mktime(&rtcinfo);
+	}
+	report("ds3231_get_time+mktime", BENCH_ITERATIONS, host_now_us() - t0);
+
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS; i++) ds3231_get_epoch(&dev, &epoch);
+	report("ds3231_get_epoch", BENCH_ITERATIONS, host_now_us() - t0);
+
+	// The time once sys_clock.c has seeded the system clock from the RTC:
+	// a timer read per call, no bus traffic.
+	struct timeval tv;
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS; i++) gettimeofday(&tv, NULL);
+	report("gettimeofday", BENCH_ITERATIONS, host_now_us() - t0);
+
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS; i++) sink = time(NULL);
+	report("time", BENCH_ITERATIONS, host_now_us() - t0);
+
+	uint8_t regs[7];
+	i2c_dev_read_reg(&dev, DS3231_ADDR_TIME, regs, sizeof(regs));
+	i2c_sim_reset_stats();
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS * 100; i++)
+	{
+		ds3231_decode_time(regs, &rtcinfo);
+		rtcinfo.tm_year -= 1900;
+		rtcinfo.tm_isdst = -1;
+		sink = mktime(&rtcinfo);
+	}
+	report("decode_time+mktime", BENCH_ITERATIONS * 100, host_now_us() - t0);
+	epoch = sink;
+
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS * 100; i++) sink = ds3231_decode_epoch(regs);
+	report("ds3231_decode_epoch", BENCH_ITERATIONS * 100, host_now_us() - t0);
+	ESP_LOGI(TAG, "mktime %lld, ds3231_decode_epoch %lld", (long long)epoch, (long long)sink);
+
+	// BCD conversion of the time block, per byte against word-parallel
+	uint8_t fields[7];
+	volatile bool valid;
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS * 100; i++)
+	{
+		regs[0] = i % 0x5a;
+		valid = bcd_unpack_scalar(regs, fields);
+	}
+	report("bcd2dec x7", BENCH_ITERATIONS * 100, host_now_us() - t0);
+
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS * 100; i++)
+	{
+		regs[0] = i % 0x5a;
+		valid = ds3231_bcd_unpack(regs, fields);
+	}
+	report("ds3231_bcd_unpack", BENCH_ITERATIONS * 100, host_now_us() - t0);
+
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS * 100; i++)
+	{
+		fields[0] = i % 60;
+		for (int j = 0; j < 7; j++) regs[j] = dec2bcd(fields[j]);
+	}
+	report("dec2bcd x7", BENCH_ITERATIONS * 100, host_now_us() - t0);
+
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS * 100; i++)
+	{
+		fields[0] = i % 60;
+		ds3231_bcd_pack(fields, regs);
+	}
+	report("ds3231_bcd_pack", BENCH_ITERATIONS * 100, host_now_us() - t0);
+	(void)valid;
+
+	// Local time of a clock ticking once a second: newlib's POSIX TZ rules
+	// against the cached transition
+	tz_t tz;
+	tz_init(&tz, tz_find("Europe/Brussels"), 0);
+	setenv("TZ", "CET-1CEST,M3.5.0,M10.5.0/3", 1);
+	tzset();
+	ds3231_get_epoch(&dev, &epoch);
+	struct tm local;
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS * 100; i++)
+	{
+		time_t t = epoch + i;
+		localtime_r(&t, &local);
+	}
+	report("localtime_r", BENCH_ITERATIONS * 100, host_now_us() - t0);
+
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS * 100; i++) tz_localtime(&tz, epoch + i, &local);
+	report("tz_localtime", BENCH_ITERATIONS * 100, host_now_us() - t0);
+	unsetenv("TZ");
+	tzset();
+
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS; i++) ds3231_get_temp_float(&dev, &temp);
+	report("ds3231_get_temp_float", BENCH_ITERATIONS, host_now_us() - t0);
+
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS; i++) ds3231_get_time_temp(&dev, &rtcinfo, &temp);
+	report("ds3231_get_time_temp", BENCH_ITERATIONS, host_now_us() - t0);
+
+	// getClock() at 1 Hz: the temperature is only read once per conversion
+	// cycle, a forced conversion picks up a change at once. Every read goes
+	// through submit, the bus task and wait, none of which may allocate.
+	size_t heap = mallinfo2().uordblks;
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS; i++)
+	{
+		i2c_sim_advance_us(1000000);
+		ds3231_get_time_temp(&dev, &rtcinfo, &temp);
+	}
+	int64_t heap_delta = (int64_t)mallinfo2().uordblks - (int64_t)heap;
+	report("ds3231_get_time_temp 1Hz", BENCH_ITERATIONS, host_now_us() - t0);
+	if (heap_delta != 0) {
+		ESP_LOGE(TAG, "Heap changed by %"PRId64" bytes over the 1 Hz loop", heap_delta);
+		exit(1);
+	}
+
+	// getClock() as it runs now: time from the system clock, the temperature
+	// from the cache keyed on it
+	ds3231_get_epoch(&dev, &epoch);
+	i2c_sim_reset_stats();
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS; i++)
+	{
+		gettimeofday(&tv, NULL);
+		ds3231_get_temp_at(&dev, epoch + i, &temp);
+	}
+	report("gettimeofday+temp_at 1Hz", BENCH_ITERATIONS, host_now_us() - t0);
+	ds3231_sim_set_temp(&rtc, 31.5);
+	ds3231_get_time_temp(&dev, &rtcinfo, &temp);
+	float fresh;
+	ds3231_get_temp_fresh(&dev, &fresh);
+	ESP_LOGI(TAG, "cached %.2f, fresh %.2f deg Cel", temp, fresh);
+	report("ds3231_get_temp_fresh", 1, host_now_us() - t0);
+
+	// A target that stops answering for two transactions is ridden through by
+	// the retry budget; one that stays down surfaces the error.
+	i2c_sim_inject_faults(I2CDEV_RETRIES, ESP_ERR_TIMEOUT);
+	esp_err_t res = ds3231_get_time(&dev, &rtcinfo);
+	i2c_sim_get_stats(&stats);
+	ESP_LOGI(TAG, "%d faults, %"PRIu32" recoveries: %s", I2CDEV_RETRIES, stats.recoveries, esp_err_to_name(res));
+	i2c_sim_reset_stats();
+	i2c_sim_inject_faults(I2CDEV_RETRIES + 1, ESP_ERR_TIMEOUT);
+	res = ds3231_get_time(&dev, &rtcinfo);
+	i2c_sim_get_stats(&stats);
+	ESP_LOGI(TAG, "%d faults, %"PRIu32" recoveries: %s", I2CDEV_RETRIES + 1, stats.recoveries, esp_err_to_name(res));
+	i2c_sim_reset_stats();
+
+	// A fault burst at the full polling rate: each distinct error is logged
+	// once per window, the repeats are only counted.
+	i2c_sim_inject_faults(BENCH_ITERATIONS / 10, ESP_ERR_TIMEOUT);
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS / 10; i++) ds3231_get_time(&dev, &rtcinfo);
+	report("ds3231_get_time faulty", BENCH_ITERATIONS / 10, host_now_us() - t0);
+	i2c_log_flush();
+
+	// Alarms: program both, read them back, let a minute pass and check that
+	// alarm 2 fired and alarm 1 did not.
+	struct tm a1 = { .tm_sec = 30, .tm_min = 15, .tm_hour = 7, .tm_wday = 2 }, a1r, a2r;
+	ds3231_alarm1_rate_t r1;
+	ds3231_alarm2_rate_t r2;
+	ds3231_alarm_t flags;
+	ds3231_set_alarm(&dev, DS3231_ALARM_BOTH, &a1, DS3231_ALARM1_MATCH_SECMINHOURDAY, NULL, DS3231_ALARM2_EVERY_MIN);
+	ds3231_enable_alarm_ints(&dev, DS3231_ALARM_2);
+	ds3231_clear_alarm_flags(&dev, DS3231_ALARM_BOTH);
+	ds3231_get_alarm(&dev, &a1r, &r1, &a2r, &r2);
+	i2c_sim_advance_us(60000000);
+	ds3231_get_alarm_flags(&dev, &flags);
+	ESP_LOGI(TAG, "alarm 1 %02d:%02d:%02d wday %d rate %d, alarm 2 rate %d, flags after a minute 0x%x",
+		a1r.tm_hour, a1r.tm_min, a1r.tm_sec, a1r.tm_wday, r1, r2, flags);
+	if (a1r.tm_sec != a1.tm_sec || a1r.tm_min != a1.tm_min || a1r.tm_hour != a1.tm_hour
+		|| a1r.tm_wday != a1.tm_wday || r1 != DS3231_ALARM1_MATCH_SECMINHOURDAY
+		|| r2 != DS3231_ALARM2_EVERY_MIN || flags != DS3231_ALARM_2) {
+		ESP_LOGE(TAG, "Alarm round trip mismatch");
+		exit(1);
+	}
+	ds3231_clear_alarm_flags(&dev, DS3231_ALARM_2);
+
+	// Alarm, control and aging registers come from the shadow after the
+	// first access, and a control update that changes nothing stays local.
+	i2c_sim_reset_stats();
+	t0 = host_now_us();
+	for (int i = 0; i < BENCH_ITERATIONS; i++)
+	{
+		ds3231_get_alarm(&dev, &a1r, &r1, &a2r, &r2);
+		ds3231_enable_alarm_ints(&dev, DS3231_ALARM_2);
+	}
+	report("ds3231 cached alarm/ctrl", BENCH_ITERATIONS, host_now_us() - t0);
+
+	ESP_LOGI(TAG, "%04d-%02d-%02d %02d:%02d:%02d, %.2f deg Cel",
+		rtcinfo.tm_year, rtcinfo.tm_mon + 1,
+		rtcinfo.tm_mday, rtcinfo.tm_hour, rtcinfo.tm_min, rtcinfo.tm_sec, temp);
+	i2c_stats_print();
+	exit(0);
+}
+
+void app_main()
+{
+	xTaskCreate(benchClock, "benchClock", 1024*4, NULL, 2, NULL);
+}
@@ -0,0 +1,304 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+
+#include "i2c_bus.h"
+#include "i2cdev_stats.h"
+#include "i2cdev_log.h"
+
+#define TAG "I2CBUS"
+
+typedef struct {
+	void *bus;
+	TaskHandle_t task;
+	portMUX_TYPE lock;
+	i2c_dev_xfer_t *pending[I2C_BUS_QUEUE_LEN];	// sorted by priority, FIFO within a priority
+	size_t count;
+	const void *last_entry;		// registry entry of the device served last
+	uint8_t burst;				// transactions in a row it was served
+	bool stopping;				// set by i2c_bus_deinit
+	SemaphoreHandle_t exited;	// given by the task when it is done with the bus
+	StaticSemaphore_t exited_buf;
+} i2c_bus_ctx_t;
+
+static i2c_bus_ctx_t buses[I2C_NUM_MAX];
+
+// A waiter may return and release 'xfer' as soon as it sees the result, so
+// nothing is read from it after that.
+static void xfer_complete(i2c_dev_xfer_t *xfer, esp_err_t res)
+{
+	i2c_dev_done_cb_t done = xfer->done;
+	TaskHandle_t notify = xfer->notify;
+	xfer->res = res;
+	if (done) done(xfer);
+	if (notify) xTaskNotifyGiveIndexed(notify, I2CDEV_NOTIFY_INDEX);
+}
+
+static void pending_remove(i2c_bus_ctx_t *ctx, size_t i)
+{
+	memmove(&ctx->pending[i], &ctx->pending[i + 1], (ctx->count - i - 1) * sizeof(ctx->pending[0]));
+	ctx->count--;
+}
+
+// Descriptors of one physical device share a registry entry, so that is
+// what identifies the device, not the descriptor.
+static bool same_device(const i2c_dev_t *a, const i2c_dev_t *b)
+{
+	return a == b || (a->entry && a->entry == b->entry);
+}
+
+// Head of the queue, except that among transactions of the head's priority the
+// device served last is preferred, so a burst to one device is not split by a
+// clock-speed switch to another. After I2C_BUS_MAX_BURST the queue goes back
+// to FIFO, so a device that keeps requeuing cannot starve the others.
+static i2c_dev_xfer_t *pending_pop(i2c_bus_ctx_t *ctx)
+{
+	size_t pick = 0;
+
+	for (size_t i = 0; ctx->burst < I2C_BUS_MAX_BURST && i < ctx->count
+		&& ctx->pending[i]->prio == ctx->pending[0]->prio; i++)
+	{
+		if (ctx->pending[i]->dev->entry == ctx->last_entry)
+		{
+			pick = i;
+			break;
+		}
+	}
+	i2c_dev_xfer_t *xfer = ctx->pending[pick];
+	pending_remove(ctx, pick);
+	if (xfer->dev->entry != ctx->last_entry) ctx->burst = 0;
+	if (ctx->burst < I2C_BUS_MAX_BURST) ctx->burst++;
+	ctx->last_entry = xfer->dev->entry;
+	return xfer;
+}
+
+static bool same_read(const i2c_dev_xfer_t *a, const i2c_dev_xfer_t *b)
+{
+	return same_device(a->dev, b->dev) && b->in_data && b->in_size == a->in_size
+		&& b->out_reg_size == a->out_reg_size
+		&& (!a->out_reg_size || !memcmp(b->out_reg, a->out_reg, a->out_reg_size));
+}
+
+// Reads of the same registers that queued up while 'xfer' was on the wire are
+// answered with its data instead of another transaction, unless a write to
+// the device is pending and could change what they should see.
+static void coalesce_reads(i2c_bus_ctx_t *ctx, const i2c_dev_xfer_t *xfer, esp_err_t res)
+{
+	i2c_dev_xfer_t *done[I2C_BUS_QUEUE_LEN];
+	size_t n = 0;
+
+	if (!xfer->in_data) return;
+
+	portENTER_CRITICAL(&ctx->lock);
+	for (size_t i = 0; i < ctx->count; i++)
+	{
+		if (same_device(ctx->pending[i]->dev, xfer->dev) && !ctx->pending[i]->in_data)
+		{
+			portEXIT_CRITICAL(&ctx->lock);
+			return;
+		}
+	}
+	for (size_t i = 0; i < ctx->count;)
+	{
+		if (same_read(xfer, ctx->pending[i]))
+		{
+			done[n++] = ctx->pending[i];
+			pending_remove(ctx, i);
+		}
+		else i++;
+	}
+	portEXIT_CRITICAL(&ctx->lock);
+
+	for (size_t i = 0; i < n; i++)
+	{
+		if (res == ESP_OK) memcpy(done[i]->in_data, xfer->in_data, xfer->in_size);
+		i2c_stats_record_coalesced(done[i]);
+		xfer_complete(done[i], res);
+	}
+}
+
+// A failed transaction is retried up to dev->retries times. Before each retry
+// the bus is recovered, in case the target was left driving SDA, and the task
+// backs off so a device that is busy or browning out gets time to come back.
+// The result of the last attempt is returned.
+static esp_err_t run_xfer(i2c_bus_ctx_t *ctx, i2c_dev_xfer_t *xfer)
+{
+	const i2c_dev_backend_t *backend = i2c_dev_get_backend();
+	esp_err_t res;
+
+	for (unsigned attempt = 0;; attempt++)
+	{
+		i2c_dev_sync(xfer->dev);
+		int64_t start = backend->now_us();
+		res = backend->transfer(xfer);
+		i2c_stats_record(xfer, res, start, backend->now_us());
+		i2c_dev_rate_feedback(xfer->dev, res);
+		if (res == ESP_OK || res == ESP_ERR_INVALID_ARG || res == ESP_ERR_INVALID_SIZE
+			|| attempt >= xfer->dev->retries)
+			return res;
+
+		if (!xfer->quiet) i2c_log_error(xfer->dev, I2C_LOG_RETRY, res, attempt + 1);
+		esp_err_t rec = backend->recover(ctx->bus);
+		if (rec != ESP_OK) i2c_log_error(xfer->dev, I2C_LOG_RECOVER, rec, 0);
+		TickType_t backoff = pdMS_TO_TICKS(I2CDEV_RETRY_BACKOFF_MS << attempt);
+		vTaskDelay(backoff ? backoff : 1);
+	}
+}
+
+// Sleep until woken, or until a log window with unreported repeats ends so
+// its summary goes out even if the bus stays quiet.
+static TickType_t log_wait(void)
+{
+	int64_t due = i2c_log_next_flush_us();
+	if (due < 0) return portMAX_DELAY;
+	int64_t left = due - i2c_dev_get_backend()->now_us();
+	return left > 0 ? pdMS_TO_TICKS(left / 1000) + 1 : 1;
+}
+
+static void i2c_bus_task(void *pvParameters)
+{
+	i2c_bus_ctx_t *ctx = pvParameters;
+
+	while (1) {
+		portENTER_CRITICAL(&ctx->lock);
+		i2c_dev_xfer_t *xfer = ctx->count ? pending_pop(ctx) : NULL;
+		bool stopping = ctx->stopping;
+		portEXIT_CRITICAL(&ctx->lock);
+
+		if (!xfer)
+		{
+			// idle: format the errors queued since, then sleep
+			i2c_log_flush();
+			if (stopping)
+			{
+				// the bus is not touched after this
+				xSemaphoreGive(ctx->exited);
+				vTaskDelete(NULL);
+			}
+			ulTaskNotifyTake(pdTRUE, log_wait());
+			continue;
+		}
+
+		// the one place a failed transaction is logged
+		esp_err_t res = run_xfer(ctx, xfer);
+		if (res != ESP_OK && !xfer->quiet) i2c_log_error(xfer->dev, I2C_LOG_XFER, res, 0);
+		coalesce_reads(ctx, xfer, res);
+		xfer_complete(xfer, res);
+	}
+}
+
+// Error records are formatted by the task of the first live bus.
+static void update_log_flusher(void)
+{
+	TaskHandle_t task = NULL;
+	for (int i = 0; i < I2C_NUM_MAX && !task; i++) task = buses[i].task;
+	i2c_log_set_flusher(task);
+}
+
+esp_err_t i2c_bus_init(i2c_port_t port, int sda, int scl)
+{
+	if (port >= I2C_NUM_MAX) return ESP_ERR_INVALID_ARG;
+
+	i2c_bus_ctx_t *ctx = &buses[port];
+	if (ctx->bus) return ESP_OK;
+
+	esp_err_t res = i2c_dev_get_backend()->bus_init(port, sda, scl, &ctx->bus);
+	if (res != ESP_OK) return res;
+
+	portMUX_INITIALIZE(&ctx->lock);
+	ctx->exited = xSemaphoreCreateBinaryStatic(&ctx->exited_buf);
+	if (xTaskCreate(i2c_bus_task, "i2c_bus", I2C_BUS_TASK_STACK, ctx, I2C_BUS_TASK_PRIO, &ctx->task) != pdPASS)
+	{
+		ESP_LOGE(TAG, "Could not start bus task for port %d", port);
+		vSemaphoreDelete(ctx->exited);
+		i2c_dev_get_backend()->bus_del(ctx->bus);
+		memset(ctx, 0, sizeof(*ctx));
+		return ESP_ERR_NO_MEM;
+	}
+	update_log_flusher();
+	return ESP_OK;
+}
+
+// Stops the bus task and releases the backend bus. Nothing may be queued.
+// The task is asked to exit rather than deleted, so a transaction still on
+// the wire or a log flush in progress finishes first; this waits for it.
+esp_err_t i2c_bus_deinit(i2c_port_t port)
+{
+	if (port >= I2C_NUM_MAX) return ESP_ERR_INVALID_ARG;
+
+	i2c_bus_ctx_t *ctx = &buses[port];
+	if (!ctx->bus) return ESP_OK;
+
+	portENTER_CRITICAL(&ctx->lock);
+	if (ctx->count)
+	{
+		portEXIT_CRITICAL(&ctx->lock);
+		return ESP_ERR_INVALID_STATE;
+	}
+	TaskHandle_t task = ctx->task;
+	ctx->task = NULL;
+	ctx->stopping = true;
+	portEXIT_CRITICAL(&ctx->lock);
+
+	update_log_flusher();
+	xTaskNotifyGive(task);
+	xSemaphoreTake(ctx->exited, portMAX_DELAY);
+	vSemaphoreDelete(ctx->exited);
+	esp_err_t res = i2c_dev_get_backend()->bus_del(ctx->bus);
+	memset(ctx, 0, sizeof(*ctx));
+	return res;
+}
+
+void *i2c_bus_get_handle(i2c_port_t port)
+{
+	return port < I2C_NUM_MAX ? buses[port].bus : NULL;
+}
+
+esp_err_t i2c_bus_submit(i2c_dev_xfer_t *xfer)
+{
+	if (!xfer || !xfer->dev || xfer->dev->port >= I2C_NUM_MAX) return ESP_ERR_INVALID_ARG;
+
+	i2c_bus_ctx_t *ctx = &buses[xfer->dev->port];
+	xfer->res = ESP_ERR_NOT_FINISHED;
+
+	// the task is read under the lock, i2c_bus_deinit clears it there
+	portENTER_CRITICAL(&ctx->lock);
+	TaskHandle_t task = ctx->task;
+	if (!task || ctx->count == I2C_BUS_QUEUE_LEN)
+	{
+		portEXIT_CRITICAL(&ctx->lock);
+		return task ? ESP_ERR_NO_MEM : ESP_ERR_INVALID_STATE;
+	}
+	size_t i = ctx->count;
+	while (i > 0 && ctx->pending[i - 1]->prio < xfer->prio) i--;
+	memmove(&ctx->pending[i + 1], &ctx->pending[i], (ctx->count - i) * sizeof(ctx->pending[0]));
+	ctx->pending[i] = xfer;
+	ctx->count++;
+	portEXIT_CRITICAL(&ctx->lock);
+
+	xTaskNotifyGive(task);
+	return ESP_OK;
+}
+
+bool i2c_bus_cancel(i2c_dev_xfer_t *xfer)
+{
+	i2c_bus_ctx_t *ctx = &buses[xfer->dev->port];
+	bool removed = false;
+
+	portENTER_CRITICAL(&ctx->lock);
+	for (size_t i = 0; i < ctx->count; i++)
+	{
+		if (ctx->pending[i] == xfer)
+		{
+			pending_remove(ctx, i);
+			removed = true;
+			break;
+		}
+	}
+	portEXIT_CRITICAL(&ctx->lock);
+	return removed;
+}
@@ -0,0 +1,19 @@
+#ifndef MAIN_I2C_BUS_H_
+#define MAIN_I2C_BUS_H_
+
+#include "i2cdev.h"
+
+#define I2C_BUS_QUEUE_LEN 16	// pending transactions per port
+#define I2C_BUS_MAX_BURST 4		// transactions in a row one device may be preferred for
+#define I2C_BUS_TASK_STACK 1024*3
+#define I2C_BUS_TASK_PRIO 5
+
+// The bus manager owns the backend bus of a port and a single bus task
+// that drains a priority queue of transactions. A transaction that is already
+// on the wire always completes; preemption happens between transactions.
+esp_err_t i2c_bus_init(i2c_port_t port, int sda, int scl);
+esp_err_t i2c_bus_deinit(i2c_port_t port);
+void *i2c_bus_get_handle(i2c_port_t port);
+esp_err_t i2c_bus_submit(i2c_dev_xfer_t *xfer);
+bool i2c_bus_cancel(i2c_dev_xfer_t *xfer);
+#endif /* MAIN_I2C_BUS_H_ */
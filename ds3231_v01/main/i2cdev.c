@@ -1,72 +1,494 @@
 #include <string.h>
 #include <time.h>
+#include <inttypes.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 
-#include "driver/i2c.h"
 #include "esp_log.h"
+#include "esp_attr.h"
 
 #include "i2cdev.h"
+#include "i2c_bus.h"
 
 #define TAG "I2CDEV"
 
+#if CONFIG_IDF_TARGET_LINUX
+static const i2c_dev_backend_t *backend = &i2c_dev_sim_backend;
+#else
+static const i2c_dev_backend_t *backend = &i2c_dev_esp_backend;
+#endif
+
+// Must be called before the first i2c_dev_init().
+void i2c_dev_set_backend(const i2c_dev_backend_t *b)
+{
+	backend = b;
+}
+
+const i2c_dev_backend_t *i2c_dev_get_backend(void)
+{
+	return backend;
+}
+
+// One entry per physical device. Descriptors of the same (port, address)
+// share its backend handle and clock, so only the first one pays for adding
+// the device and negotiating its speed.
+typedef struct {
+	i2c_port_t port;
+	uint8_t addr;
+	uint8_t refs;			// descriptors using the entry, 0 if free
+	bool negotiated;
+	uint32_t clk_speed;
+	uint32_t ceiling;		// clock negotiation accepted, fallbacks climb back to it
+	void *handle;
+} i2c_dev_entry_t;
+
+// Clock of each device before the last deep sleep. RTC memory is only kept
+// across deep sleep, so a match means the same device on the same bus and
+// the probe reads of the speed negotiation can be skipped after a wake.
+typedef struct {
+	uint8_t port;
+	uint8_t addr;			// 0 if unused
+	uint32_t clk_speed;
+	uint32_t ceiling;
+} i2c_dev_wake_t;
+
+static i2c_dev_entry_t entries[I2CDEV_MAX_DEVICES];
+static uint8_t bus_refs[I2C_NUM_MAX];		// registered descriptors per port
+static SemaphoreHandle_t registry;
+RTC_DATA_ATTR static i2c_dev_wake_t wake_speeds[I2CDEV_MAX_DEVICES];
+
+static void registry_lock(void)
+{
+	static StaticSemaphore_t buf;
+	static portMUX_TYPE init_lock = portMUX_INITIALIZER_UNLOCKED;
+
+	portENTER_CRITICAL(&init_lock);
+	if (!registry) registry = xSemaphoreCreateMutexStatic(&buf);
+	portEXIT_CRITICAL(&init_lock);
+	xSemaphoreTake(registry, portMAX_DELAY);
+}
+
+// For the bus task, which must not wait: whoever holds the registry may be
+// waiting for a transaction of it.
+static bool registry_try_lock(void)
+{
+	return registry && xSemaphoreTake(registry, 0) == pdTRUE;
+}
+
+static void registry_unlock(void)
+{
+	xSemaphoreGive(registry);
+}
+
+static i2c_dev_entry_t *entry_find(i2c_port_t port, uint8_t addr)
+{
+	for (int i = 0; i < I2CDEV_MAX_DEVICES; i++)
+	{
+		if (entries[i].refs && entries[i].port == port && entries[i].addr == addr) return &entries[i];
+	}
+	return NULL;
+}
+
+static i2c_dev_wake_t *wake_find(i2c_port_t port, uint8_t addr, bool alloc)
+{
+	i2c_dev_wake_t *free = NULL;
+
+	for (int i = 0; i < I2CDEV_MAX_DEVICES; i++)
+	{
+		if (wake_speeds[i].addr == addr && wake_speeds[i].port == port) return &wake_speeds[i];
+		if (!wake_speeds[i].addr && !free) free = &wake_speeds[i];
+	}
+	if (!alloc || !free) return NULL;
+	free->port = port;
+	free->addr = addr;
+	return free;
+}
+
+// Installs the bus of a port on first use; later calls only check the port.
 esp_err_t i2c_dev_init(i2c_port_t port, int sda, int scl)
 {
-	i2c_config_t i2c_config = {
-		.mode = I2C_MODE_MASTER,
-		.sda_io_num = sda,
-		.scl_io_num = scl,
-		.sda_pullup_en = GPIO_PULLUP_ENABLE,
-		.scl_pullup_en = GPIO_PULLUP_ENABLE,
-		//.master.clk_speed = 1000000
-		.master.clk_speed = I2C_FREQ_HZ
+	registry_lock();
+	esp_err_t res = i2c_bus_init(port, sda, scl);
+	registry_unlock();
+	return res;
+}
+
+static esp_err_t negotiate(i2c_dev_t *dev);
+
+// Registers a descriptor. The first descriptor of a device adds it to the
+// bus and negotiates its clock, or takes the clock it had before deep sleep;
+// later ones share that handle and clock.
+esp_err_t i2c_dev_add(i2c_dev_t *dev)
+{
+	if (!dev) return ESP_ERR_INVALID_ARG;
+
+	registry_lock();
+	void *bus = i2c_bus_get_handle(dev->port);
+	if (!bus)
+	{
+		registry_unlock();
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	if (!dev->clk_speed) dev->clk_speed = I2C_FREQ_HZ;
+	if (dev->max_clk_speed < dev->clk_speed) dev->max_clk_speed = dev->clk_speed;
+	dev->rate_xfers = dev->rate_errors = dev->rate_clean = 0;
+
+	esp_err_t res = ESP_OK;
+	i2c_dev_entry_t *entry = entry_find(dev->port, dev->addr);
+	if (entry) entry->refs++;
+	else
+	{
+		for (int i = 0; i < I2CDEV_MAX_DEVICES && !entry; i++)
+		{
+			if (!entries[i].refs) entry = &entries[i];
+		}
+		if (!entry)
+		{
+			registry_unlock();
+			return ESP_ERR_NO_MEM;
+		}
+
+		i2c_dev_wake_t *wake = wake_find(dev->port, dev->addr, false);
+		bool resume = wake && wake->ceiling && wake->ceiling <= dev->max_clk_speed;
+		if (resume) dev->clk_speed = wake->clk_speed;
+
+		res = backend->add(bus, dev);
+		if (res != ESP_OK)
+		{
+			registry_unlock();
+			return res;
+		}
+		*entry = (i2c_dev_entry_t){
+			.port = dev->port,
+			.addr = dev->addr,
+			.refs = 1,
+			.negotiated = resume,
+			.clk_speed = dev->clk_speed,
+			.ceiling = resume ? wake->ceiling : dev->clk_speed,
+			.handle = dev->handle,
+		};
+		dev->entry = entry;
+		res = negotiate(dev);
+		if (res != ESP_OK)
+		{
+			// stuck at a clock it could not go back from: the device is not
+			// registered at all, rather than half
+			backend->remove(dev);
+			memset(entry, 0, sizeof(*entry));
+			dev->entry = NULL;
+			dev->handle = NULL;
+			registry_unlock();
+			return res;
+		}
+	}
+	dev->entry = entry;
+	dev->handle = entry->handle;
+	dev->clk_speed = entry->clk_speed;
+	bus_refs[dev->port]++;
+	registry_unlock();
+	return res;
+}
+
+// Releases a descriptor. The device leaves the bus with its last descriptor,
+// and the bus is deleted with its last device.
+esp_err_t i2c_dev_remove(i2c_dev_t *dev)
+{
+	if (!dev || !dev->entry) return ESP_ERR_INVALID_ARG;
+
+	registry_lock();
+	i2c_dev_entry_t *entry = dev->entry;
+	esp_err_t res = ESP_OK;
+	i2c_dev_sync(dev);
+	if (--entry->refs == 0) res = backend->remove(dev);
+	dev->entry = NULL;
+	dev->handle = NULL;
+	if (--bus_refs[dev->port] == 0)
+	{
+		esp_err_t bus_res = i2c_bus_deinit(dev->port);
+		if (res == ESP_OK) res = bus_res;
+	}
+	registry_unlock();
+	return res;
+}
+
+// Picks up a handle or clock change made through another descriptor of the
+// same device. Called by the bus task before every transaction.
+void i2c_dev_sync(i2c_dev_t *dev)
+{
+	i2c_dev_entry_t *entry = dev->entry;
+	if (!entry || (dev->handle == entry->handle && dev->clk_speed == entry->clk_speed)) return;
+	dev->handle = entry->handle;
+	dev->clk_speed = entry->clk_speed;
+}
+
+static const uint32_t speeds[] = { 100000, I2C_FREQ_HZ, I2C_FREQ_FAST_PLUS_HZ };
+
+static esp_err_t set_speed(i2c_dev_t *dev, uint32_t hz)
+{
+	i2c_dev_sync(dev);
+	esp_err_t res = backend->set_speed(i2c_bus_get_handle(dev->port), dev, hz);
+
+	i2c_dev_entry_t *entry = dev->entry;
+	if (entry)
+	{
+		entry->handle = dev->handle;
+		entry->clk_speed = dev->clk_speed;
+	}
+	i2c_dev_wake_t *wake = wake_find(dev->port, dev->addr, true);
+	if (wake) wake->clk_speed = dev->clk_speed;
+	return res;
+}
+
+// Read of register 0 at a clock under test. Failing is what it is there to
+// find out, so it stays out of the error log.
+static esp_err_t probe(i2c_dev_t *dev)
+{
+	uint8_t reg = 0, val;
+	i2c_dev_xfer_t xfer = {
+		.dev = dev,
+		.out_reg = &reg,
+		.out_reg_size = 1,
+		.in_data = &val,
+		.in_size = 1,
+		.prio = dev->prio,
+		.quiet = true,
 	};
-	//i2c_param_config(I2C_NUM_0, &i2c_config);
-	//i2c_driver_install(I2C_NUM_0, I2C_MODE_MASTER, 0, 0, 0);
-	i2c_param_config(port, &i2c_config);
-	return i2c_driver_install(port, I2C_MODE_MASTER, 0, 0, 0);
+	return i2c_dev_transfer(&xfer);
 }
 
-esp_err_t i2c_dev_read(const i2c_dev_t *dev, const void *out_data, size_t out_size, void *in_data, size_t in_size)
+// Steps the clock up towards max_clk_speed, keeping the fastest rung at which
+// a burst of probe reads of register 0 all succeed. The registry holds the
+// device meanwhile, so no other descriptor of it is handed out.
+static esp_err_t negotiate(i2c_dev_t *dev)
 {
-	if (!dev || !in_data || !in_size) return ESP_ERR_INVALID_ARG;
+	i2c_dev_entry_t *entry = dev->entry;
+	if (entry->negotiated) return ESP_OK;
+
+	uint32_t base = dev->clk_speed;
+	bool accepted = false;
+	for (int i = sizeof(speeds) / sizeof(speeds[0]) - 1; i >= 0 && !accepted; i--)
+	{
+		if (speeds[i] <= base || speeds[i] > dev->max_clk_speed) continue;
+		if (set_speed(dev, speeds[i]) != ESP_OK) continue;
+
+		int ok = 0;
+		while (ok < I2CDEV_PROBE_READS && probe(dev) == ESP_OK) ok++;
+		accepted = ok == I2CDEV_PROBE_READS;
+		if (!accepted)
+			ESP_LOGW(TAG, "Device [0x%02x at %d] failed at %"PRIu32" Hz", dev->addr, dev->port, speeds[i]);
+	}
 
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-	if (out_data && out_size)
+	esp_err_t res = ESP_OK;
+	if (!accepted && dev->clk_speed != base) res = set_speed(dev, base);
+	dev->rate_xfers = dev->rate_errors = dev->rate_clean = 0;
+	entry->negotiated = res == ESP_OK;
+	entry->ceiling = dev->clk_speed;
+	i2c_dev_wake_t *wake = res == ESP_OK ? wake_find(dev->port, dev->addr, true) : NULL;
+	if (wake)
 	{
-		i2c_master_start(cmd);
-		i2c_master_write_byte(cmd, (dev->addr << 1) | I2C_MASTER_WRITE, true);
-		i2c_master_write(cmd, (void *)out_data, out_size, true);
+		wake->clk_speed = dev->clk_speed;
+		wake->ceiling = dev->clk_speed;
 	}
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, (dev->addr << 1) | 1, true);
-	i2c_master_read(cmd, in_data, in_size, I2C_MASTER_LAST_NACK);
-	i2c_master_stop(cmd);
+	if (dev->clk_speed != base)
+		ESP_LOGI(TAG, "Device [0x%02x at %d] runs at %"PRIu32" Hz", dev->addr, dev->port, dev->clk_speed);
+	return res;
+}
 
-	esp_err_t res = i2c_master_cmd_begin(dev->port, cmd, I2CDEV_TIMEOUT / portTICK_PERIOD_MS);
-	if (res != ESP_OK)
-		ESP_LOGE(TAG, "Could not read from device [0x%02x at %d]: %d", dev->addr, dev->port, res);
-	i2c_cmd_link_delete(cmd);
+// Renegotiates the clock of a registered device, for instance after its
+// supply or wiring changed. i2c_dev_add() negotiates once per boot by itself.
+esp_err_t i2c_dev_negotiate_speed(i2c_dev_t *dev)
+{
+	if (!dev || !dev->handle || !dev->entry) return ESP_ERR_INVALID_ARG;
 
+	registry_lock();
+	((i2c_dev_entry_t *)dev->entry)->negotiated = false;
+	esp_err_t res = negotiate(dev);
+	registry_unlock();
 	return res;
 }
 
-esp_err_t i2c_dev_write(const i2c_dev_t *dev, const void *out_reg, size_t out_reg_size, const void *out_data, size_t out_size)
+// Rung next to 'hz' in the given direction, 0 if there is none.
+static uint32_t next_speed(uint32_t hz, bool up)
 {
-	if (!dev || !out_data || !out_size) return ESP_ERR_INVALID_ARG;
+	int n = sizeof(speeds) / sizeof(speeds[0]);
+	for (int i = 0; i < n; i++)
+	{
+		uint32_t s = speeds[up ? i : n - 1 - i];
+		if (up ? s > hz : s < hz) return s;
+	}
+	return 0;
+}
 
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, (dev->addr << 1) | I2C_MASTER_WRITE, true);
-	if (out_reg && out_reg_size)
-		i2c_master_write(cmd, (void *)out_reg, out_reg_size, true);
-	i2c_master_write(cmd, (void *)out_data, out_size, true);
-	i2c_master_stop(cmd);
-	esp_err_t res = i2c_master_cmd_begin(dev->port, cmd, I2CDEV_TIMEOUT / portTICK_PERIOD_MS);
-	if (res != ESP_OK)
-		ESP_LOGE(TAG, "Could not write to device [0x%02x at %d]: %d", dev->addr, dev->port, res);
-	i2c_cmd_link_delete(cmd);
+// Called by the bus task after every transaction. Too many failures within
+// a window step the device's clock down one rung; a run of clean windows
+// steps it back up, as far as negotiation got. A step needs the registry and
+// is put off to the next transaction while someone else holds it.
+void i2c_dev_rate_feedback(i2c_dev_t *dev, esp_err_t res)
+{
+	if (res != ESP_OK) dev->rate_errors++;
+	if (++dev->rate_xfers < I2CDEV_RATE_WINDOW && dev->rate_errors < I2CDEV_RATE_MAX_ERRORS) return;
 
+	bool down = dev->rate_errors >= I2CDEV_RATE_MAX_ERRORS;
+	bool up = !down && dev->rate_clean + 1 >= I2CDEV_RATE_CLEAN_WINDOWS;
+	if (down || up)
+	{
+		i2c_dev_entry_t *entry = dev->entry;
+		if (!entry || !registry_try_lock()) return;
+
+		uint32_t hz = next_speed(dev->clk_speed, up);
+		if (up && hz > entry->ceiling) hz = 0;
+		if (hz)
+		{
+			ESP_LOGW(TAG, "Device [0x%02x at %d] %s %"PRIu32" Hz", dev->addr, dev->port,
+				down ? "falls back to" : "steps back up to", hz);
+			set_speed(dev, hz);
+		}
+		registry_unlock();
+	}
+	dev->rate_clean = down || up ? 0 : dev->rate_clean + 1;
+	dev->rate_xfers = dev->rate_errors = 0;
+}
+
+// Synchronous transactions go through the bus task too, so they are arbitrated
+// against every other client of the bus.
+esp_err_t i2c_dev_transfer(i2c_dev_xfer_t *xfer)
+{
+	xfer->done = NULL;
+	xfer->notify = xTaskGetCurrentTaskHandle();
+
+	esp_err_t res = i2c_dev_submit(xfer);
+	if (res != ESP_OK) return res;
+
+	res = i2c_dev_wait(xfer, pdMS_TO_TICKS(I2CDEV_TIMEOUT * 2));
+	if (res == ESP_ERR_TIMEOUT)
+	{
+		// starved by higher-priority traffic; if it is already on the wire it
+		// has to finish before the descriptor leaves scope
+		if (!i2c_bus_cancel(xfer)) res = i2c_dev_wait(xfer, portMAX_DELAY);
+	}
 	return res;
 }
+
+esp_err_t i2c_dev_read(i2c_dev_t *dev, const void *out_data, size_t out_size, void *in_data, size_t in_size)
+{
+	if (!dev || !dev->handle || !in_data || !in_size) return ESP_ERR_INVALID_ARG;
+
+	i2c_dev_xfer_t xfer = {
+		.dev = dev,
+		.out_reg = out_data,
+		.out_reg_size = out_size,
+		.in_data = in_data,
+		.in_size = in_size,
+		.prio = dev->prio,
+	};
+	return i2c_dev_transfer(&xfer);
+}
+
+esp_err_t i2c_dev_write(i2c_dev_t *dev, const void *out_reg, size_t out_reg_size, const void *out_data, size_t out_size)
+{
+	if (!dev || !dev->handle || !out_data || !out_size) return ESP_ERR_INVALID_ARG;
+
+	i2c_dev_xfer_t xfer = {
+		.dev = dev,
+		.out_reg = out_reg,
+		.out_reg_size = out_reg_size,
+		.out_data = out_data,
+		.out_size = out_size,
+		.prio = dev->prio,
+	};
+	return i2c_dev_transfer(&xfer);
+}
+
+// Spans are sorted by register and merged while the skipped gap costs fewer
+// SCL cycles (9 per byte) than the START/address phase of another read. The
+// resulting reads are queued together so the bus task runs them back to back.
+esp_err_t i2c_dev_readv(i2c_dev_t *dev, const i2c_dev_span_t *spans, size_t count)
+{
+	if (!dev || !dev->handle || !spans || !count || count > I2CDEV_READV_MAX_SPANS) return ESP_ERR_INVALID_ARG;
+
+	const i2c_dev_span_t *order[I2CDEV_READV_MAX_SPANS];
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!spans[i].data || !spans[i].size || spans[i].size > I2CDEV_READV_MAX_BYTES) return ESP_ERR_INVALID_ARG;
+		size_t j = i;
+		for (; j > 0 && order[j - 1]->reg > spans[i].reg; j--) order[j] = order[j - 1];
+		order[j] = &spans[i];
+	}
+
+	// merged reads land in scratch, there are at most count / 2 of them
+	uint8_t scratch[I2CDEV_READV_MAX_SPANS / 2][I2CDEV_READV_MAX_BYTES];
+	i2c_dev_xfer_t xfer[I2CDEV_READV_MAX_SPANS];
+	uint8_t reg[I2CDEV_READV_MAX_SPANS];
+	size_t group_end[I2CDEV_READV_MAX_SPANS];
+	size_t groups = 0, merged = 0;
+
+	for (size_t first = 0; first < count; first = group_end[groups++])
+	{
+		unsigned start = order[first]->reg;
+		unsigned end = start + order[first]->size;
+		size_t last = first + 1;
+		for (; last < count; last++)
+		{
+			unsigned next = order[last]->reg;
+			unsigned next_end = next + order[last]->size;
+			unsigned gap = next > end ? next - end : 0;
+			if (gap * 9 >= I2CDEV_TXN_OVERHEAD_CLKS) break;
+			if ((next_end > end ? next_end : end) - start > I2CDEV_READV_MAX_BYTES) break;
+			if (next_end > end) end = next_end;
+		}
+
+		reg[groups] = start;
+		group_end[groups] = last;
+		xfer[groups] = (i2c_dev_xfer_t) {
+			.dev = dev,
+			.out_reg = &reg[groups],
+			.out_reg_size = 1,
+			.in_data = last == first + 1 ? order[first]->data : scratch[merged++],
+			.in_size = end - start,
+			.prio = dev->prio,
+			.notify = xTaskGetCurrentTaskHandle(),
+		};
+	}
+
+	size_t submitted = 0;
+	esp_err_t res = ESP_OK;
+	for (; submitted < groups && res == ESP_OK; submitted++)
+		res = i2c_dev_submit(&xfer[submitted]);
+	if (res != ESP_OK) submitted--;
+
+	for (size_t g = 0; g < submitted; g++)
+	{
+		esp_err_t r = i2c_dev_wait(&xfer[g], portMAX_DELAY);
+		if (r != ESP_OK && res == ESP_OK) res = r;
+	}
+	if (res != ESP_OK) return res;
+
+	for (size_t g = 0, first = 0; g < groups; first = group_end[g++])
+	{
+		if (group_end[g] == first + 1) continue;
+		for (size_t i = first; i < group_end[g]; i++)
+			memcpy(order[i]->data, (uint8_t *)xfer[g].in_data + (order[i]->reg - reg[g]), order[i]->size);
+	}
+	return ESP_OK;
+}
+
+esp_err_t i2c_dev_submit(i2c_dev_xfer_t *xfer)
+{
+	if (!xfer || !xfer->dev || !xfer->dev->handle) return ESP_ERR_INVALID_ARG;
+	if (xfer->in_data ? !xfer->in_size : (!xfer->out_data || !xfer->out_size)) return ESP_ERR_INVALID_ARG;
+
+	return i2c_bus_submit(xfer);
+}
+
+esp_err_t i2c_dev_wait(i2c_dev_xfer_t *xfer, TickType_t timeout)
+{
+	if (!xfer || xfer->notify != xTaskGetCurrentTaskHandle()) return ESP_ERR_INVALID_ARG;
+
+	while (xfer->res == ESP_ERR_NOT_FINISHED) {
+		if (!ulTaskNotifyTakeIndexed(I2CDEV_NOTIFY_INDEX, pdFALSE, timeout)) return ESP_ERR_TIMEOUT;
+	}
+	return xfer->res;
+}
@@ -1,28 +1,133 @@
 #ifndef MAIN_I2CDEV_H_
 #define MAIN_I2CDEV_H_
 
-#include "driver/i2c.h"
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#if CONFIG_IDF_TARGET_LINUX
+// host build: no I2C driver, transactions go to the simulator in i2cdev_sim.c
+typedef int i2c_port_t;
+typedef int gpio_num_t;
+#define I2C_NUM_0 0
+#define I2C_NUM_MAX 1
+#else
+#include "driver/i2c_master.h"
+#endif
 
 #define I2C_FREQ_HZ 400000
+#define I2C_FREQ_FAST_PLUS_HZ 1000000
+#define I2CDEV_PROBE_READS 8		// reads that must all succeed to accept a faster clock
+#define I2CDEV_RATE_WINDOW 32		// transactions per fallback window
+#define I2CDEV_RATE_MAX_ERRORS 3	// failures in a window that make the clock step down
+#define I2CDEV_RATE_CLEAN_WINDOWS 8	// windows without that many failures before it steps back up
+#define I2CDEV_MAX_DEVICES 8		// registered devices, all ports
 #define I2CDEV_TIMEOUT 1000
+#define I2CDEV_RETRIES 2			// default retries of a failed transaction
+#define I2CDEV_RETRY_BACKOFF_MS 2	// delay before the first retry, doubled for each further one
+#define I2CDEV_READV_MAX_SPANS 8
+#define I2CDEV_READV_MAX_BYTES 32	// largest merged read
+// Bus cycles of an extra register read: START, address+W, register, repeated
+// START, address+R and STOP. Gaps cheaper than this are read and discarded.
+#define I2CDEV_TXN_OVERHEAD_CLKS (3 * 9 + 2)
+// Task notification index completions are signalled on. A completion whose
+// waiter already saw the result leaves a count behind, which must not land
+// on index 0, where the application does its own waiting.
+#define I2CDEV_NOTIFY_INDEX 1
+#if configTASK_NOTIFICATION_ARRAY_ENTRIES <= I2CDEV_NOTIFY_INDEX
+#error "i2cdev needs CONFIG_FREERTOS_TASK_NOTIFICATION_ARRAY_ENTRIES >= 2, see sdkconfig.defaults"
+#endif
+
+// Bus arbitration priority. Latency-sensitive traffic such as accelerometer
+// FIFO drains uses HIGH so it is served ahead of queued RTC polls.
+typedef enum {
+	I2C_DEV_PRIO_LOW = -1,
+	I2C_DEV_PRIO_NORMAL = 0,	// default of a zero-initialised descriptor
+	I2C_DEV_PRIO_HIGH = 1,
+} i2c_dev_prio_t;
 
 typedef struct {
 	i2c_port_t port;	// I2C port number
 	uint8_t addr;		// I2C address
 	gpio_num_t sda_io_num;	// GPIO number for I2C sda signal
 	gpio_num_t scl_io_num;	// GPIO number for I2C scl signal
-	uint32_t clk_speed;		// I2C clock frequency for master mode
+	uint32_t clk_speed;		// I2C clock frequency for master mode, retuned by the bus layer
+	uint32_t max_clk_speed;	// fastest clock the device supports, 0 to keep clk_speed
+	uint16_t rate_xfers;	// transactions in the current fallback window
+	uint16_t rate_errors;	// failures in the current fallback window
+	uint16_t rate_clean;	// clean windows since the clock last changed
+	i2c_dev_prio_t prio;	// default priority of synchronous reads and writes
+	uint8_t retries;		// attempts after the first, each preceded by a bus recovery
+	void *handle;			// backend device handle, set by i2c_dev_add()
+	void *entry;			// registry entry shared with other descriptors of the device
 } i2c_dev_t;
 
+// One register span of a vectored read.
+typedef struct {
+	uint8_t reg;	// first register, the device auto-increments from here
+	void *data;
+	size_t size;
+} i2c_dev_span_t;
+
+typedef struct i2c_dev_xfer i2c_dev_xfer_t;
+typedef void (*i2c_dev_done_cb_t)(i2c_dev_xfer_t *xfer);
+
+// Asynchronous transaction. The descriptor and its buffers belong to the
+// caller and must stay valid until completion is signalled.
+struct i2c_dev_xfer {
+	i2c_dev_t *dev;
+	const void *out_reg;	// register address phase
+	size_t out_reg_size;
+	const void *out_data;	// data written after the register (write only)
+	size_t out_size;
+	void *in_data;			// data read after a repeated START, NULL for a write
+	size_t in_size;
+	i2c_dev_prio_t prio;
+	i2c_dev_done_cb_t done;	// called from the bus task, must not block on the bus, may be NULL
+	TaskHandle_t notify;	// task notified on completion at I2CDEV_NOTIFY_INDEX, may be NULL
+	bool quiet;				// failure is expected, e.g. a speed probe, and not logged
+	void *arg;
+	esp_err_t res;			// transaction result, valid after completion
+};
+
+// Bus backend. The ESP-IDF i2c_master implementation lives in i2cdev_esp.c,
+// the host simulator in i2cdev_sim.c. transfer() runs in the bus task.
+// remove() and bus_del() undo add() and bus_init().
+// recover() frees a bus a target is holding down and resets the controller.
+// now_us() is the clock transactions are timed with.
+typedef struct {
+	esp_err_t (*bus_init)(i2c_port_t port, int sda, int scl, void **bus);
+	esp_err_t (*bus_del)(void *bus);
+	esp_err_t (*add)(void *bus, i2c_dev_t *dev);
+	esp_err_t (*remove)(i2c_dev_t *dev);
+	esp_err_t (*set_speed)(void *bus, i2c_dev_t *dev, uint32_t hz);
+	esp_err_t (*transfer)(const i2c_dev_xfer_t *xfer);
+	esp_err_t (*recover)(void *bus);
+	int64_t (*now_us)(void);
+} i2c_dev_backend_t;
+
+extern const i2c_dev_backend_t i2c_dev_esp_backend;
+extern const i2c_dev_backend_t i2c_dev_sim_backend;
+
+void i2c_dev_set_backend(const i2c_dev_backend_t *backend);
+const i2c_dev_backend_t *i2c_dev_get_backend(void);
 esp_err_t i2c_dev_init(i2c_port_t port, int sda, int scl);
-esp_err_t i2c_dev_read(const i2c_dev_t *dev, const void *out_data, size_t out_size, void *in_data, size_t in_size);
-esp_err_t i2c_dev_write(const i2c_dev_t *dev, const void *out_reg, size_t out_reg_size, const void *out_data, size_t out_size);
-inline esp_err_t i2c_dev_read_reg(const i2c_dev_t *dev, uint8_t reg, void *in_data, size_t in_size)
+esp_err_t i2c_dev_add(i2c_dev_t *dev);
+esp_err_t i2c_dev_remove(i2c_dev_t *dev);
+void i2c_dev_sync(i2c_dev_t *dev);
+esp_err_t i2c_dev_negotiate_speed(i2c_dev_t *dev);
+void i2c_dev_rate_feedback(i2c_dev_t *dev, esp_err_t res);
+esp_err_t i2c_dev_read(i2c_dev_t *dev, const void *out_data, size_t out_size, void *in_data, size_t in_size);
+esp_err_t i2c_dev_write(i2c_dev_t *dev, const void *out_reg, size_t out_reg_size, const void *out_data, size_t out_size);
+esp_err_t i2c_dev_readv(i2c_dev_t *dev, const i2c_dev_span_t *spans, size_t count);
+esp_err_t i2c_dev_transfer(i2c_dev_xfer_t *xfer);
+esp_err_t i2c_dev_submit(i2c_dev_xfer_t *xfer);
+esp_err_t i2c_dev_wait(i2c_dev_xfer_t *xfer, TickType_t timeout);
+inline esp_err_t i2c_dev_read_reg(i2c_dev_t *dev, uint8_t reg, void *in_data, size_t in_size)
 {
 	return i2c_dev_read(dev, &reg, 1, in_data, in_size);
 }
 
-inline esp_err_t i2c_dev_write_reg(const i2c_dev_t *dev, uint8_t reg, const void *out_data, size_t out_size)
+inline esp_err_t i2c_dev_write_reg(i2c_dev_t *dev, uint8_t reg, const void *out_data, size_t out_size)
 {
 	return i2c_dev_write(dev, &reg, 1, out_data, out_size);
 }
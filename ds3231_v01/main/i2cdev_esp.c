@@ -0,0 +1,99 @@
+#include "driver/i2c_master.h"
+#include "esp_timer.h"
+
+#include "i2cdev.h"
+
+static esp_err_t esp_bus_init(i2c_port_t port, int sda, int scl, void **bus)
+{
+	i2c_master_bus_config_t bus_config = {
+		.i2c_port = port,
+		.sda_io_num = sda,
+		.scl_io_num = scl,
+		.clk_source = I2C_CLK_SRC_DEFAULT,
+		.glitch_ignore_cnt = 7,
+		.flags.enable_internal_pullup = true,
+	};
+	return i2c_new_master_bus(&bus_config, (i2c_master_bus_handle_t *)bus);
+}
+
+static esp_err_t esp_bus_del(void *bus)
+{
+	return i2c_del_master_bus(bus);
+}
+
+static esp_err_t esp_add(void *bus, i2c_dev_t *dev)
+{
+	i2c_device_config_t dev_config = {
+		.dev_addr_length = I2C_ADDR_BIT_LEN_7,
+		.device_address = dev->addr,
+		.scl_speed_hz = dev->clk_speed,
+	};
+	return i2c_master_bus_add_device(bus, &dev_config, (i2c_master_dev_handle_t *)&dev->handle);
+}
+
+static esp_err_t esp_remove(i2c_dev_t *dev)
+{
+	return i2c_master_bus_rm_device(dev->handle);
+}
+
+// i2c_master fixes the clock when a device is added, so retuning re-adds it.
+// The driver then switches the bus timing per transaction by device. The new
+// handle is added before the old one goes, so a failure keeps the old one.
+static esp_err_t esp_set_speed(void *bus, i2c_dev_t *dev, uint32_t hz)
+{
+	i2c_dev_t next = *dev;
+	next.clk_speed = hz;
+	esp_err_t res = esp_add(bus, &next);
+	if (res != ESP_OK) return res;
+	res = esp_remove(dev);
+	if (res != ESP_OK)
+	{
+		esp_remove(&next);
+		return res;
+	}
+	dev->handle = next.handle;
+	dev->clk_speed = hz;
+	return ESP_OK;
+}
+
+static esp_err_t esp_transfer(const i2c_dev_xfer_t *xfer)
+{
+	i2c_master_dev_handle_t handle = xfer->dev->handle;
+
+	if (xfer->in_data)
+	{
+		if (xfer->out_reg && xfer->out_reg_size)
+			return i2c_master_transmit_receive(handle, xfer->out_reg, xfer->out_reg_size,
+				xfer->in_data, xfer->in_size, I2CDEV_TIMEOUT);
+		return i2c_master_receive(handle, xfer->in_data, xfer->in_size, I2CDEV_TIMEOUT);
+	}
+
+	i2c_master_transmit_multi_buffer_info_t bufs[2];
+	size_t n = 0;
+	if (xfer->out_reg && xfer->out_reg_size)
+	{
+		bufs[n].write_buffer = (uint8_t *)xfer->out_reg;
+		bufs[n++].buffer_size = xfer->out_reg_size;
+	}
+	bufs[n].write_buffer = (uint8_t *)xfer->out_data;
+	bufs[n++].buffer_size = xfer->out_size;
+	return i2c_master_multi_buffer_transmit(handle, bufs, n, I2CDEV_TIMEOUT);
+}
+
+// Clocks SCL up to 9 times until the target releases SDA, sends a STOP and
+// resets the controller state machine.
+static esp_err_t esp_recover(void *bus)
+{
+	return i2c_master_bus_reset(bus);
+}
+
+const i2c_dev_backend_t i2c_dev_esp_backend = {
+	.bus_init = esp_bus_init,
+	.bus_del = esp_bus_del,
+	.add = esp_add,
+	.remove = esp_remove,
+	.set_speed = esp_set_speed,
+	.transfer = esp_transfer,
+	.recover = esp_recover,
+	.now_us = esp_timer_get_time,
+};
@@ -0,0 +1,189 @@
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include "i2cdev_log.h"
+
+#define TAG "I2CDEV"
+
+#define I2C_LOG_ARG_REPEATS 0xff	// record only carries the repeat count of a window
+
+// A key tracks one (device, event, error) triple. The first occurrence in a
+// window is queued as a record, later ones only bump 'suppressed'.
+typedef struct {
+	bool used;
+	uint8_t port;
+	uint8_t addr;
+	uint8_t event;
+	esp_err_t res;
+	int64_t window_us;		// start of the current window
+	uint32_t suppressed;
+} i2c_log_key_t;
+
+static i2c_log_key_t keys[I2C_LOG_KEYS];
+static i2c_log_record_t ring[I2C_LOG_RING];
+static size_t head, count;
+static uint32_t lost;		// records dropped on a full ring
+static TaskHandle_t flusher;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+// caller holds the lock
+static bool push(const i2c_log_key_t *key, uint32_t suppressed, uint8_t arg, int64_t now)
+{
+	if (count == I2C_LOG_RING)
+	{
+		lost++;
+		return false;
+	}
+	ring[(head + count++) % I2C_LOG_RING] = (i2c_log_record_t){
+		.time_us = now,
+		.res = key->res,
+		.suppressed = suppressed,
+		.port = key->port,
+		.addr = key->addr,
+		.event = key->event,
+		.arg = arg,
+	};
+	return true;
+}
+
+// caller holds the lock
+static bool flush_repeats(i2c_log_key_t *key, int64_t now)
+{
+	bool queued = false;
+	if (key->used && key->suppressed) queued = push(key, key->suppressed, I2C_LOG_ARG_REPEATS, now);
+	key->suppressed = 0;
+	return queued;
+}
+
+// Called where the error happens: no formatting, no blocking, a few compares.
+void i2c_log_error(const i2c_dev_t *dev, i2c_log_event_t event, esp_err_t res, uint8_t arg)
+{
+	int64_t now = i2c_dev_get_backend()->now_us();
+	bool queued = false;
+
+	portENTER_CRITICAL(&lock);
+	i2c_log_key_t *key = NULL, *oldest = &keys[0];
+	for (int i = 0; i < I2C_LOG_KEYS && !key; i++)
+	{
+		i2c_log_key_t *k = &keys[i];
+		if (k->used && k->res == res && k->addr == dev->addr && k->port == dev->port && k->event == event)
+			key = k;
+		else if (!k->used || (oldest->used && k->window_us < oldest->window_us))
+			oldest = k;
+	}
+
+	if (key && now - key->window_us < I2C_LOG_WINDOW_US) key->suppressed++;
+	else
+	{
+		if (!key)
+		{
+			// reuse the stalest key, keeping the repeats it still owes
+			key = oldest;
+			queued = flush_repeats(key, now);
+			*key = (i2c_log_key_t){
+				.used = true,
+				.port = dev->port,
+				.addr = dev->addr,
+				.event = event,
+				.res = res,
+			};
+		}
+		queued |= push(key, key->suppressed, arg, now);
+		key->window_us = now;
+		key->suppressed = 0;
+	}
+	TaskHandle_t task = flusher;
+	portEXIT_CRITICAL(&lock);
+
+	if (queued && task) xTaskNotifyGive(task);
+}
+
+// Task that formats the queued records when it has nothing better to do.
+void i2c_log_set_flusher(TaskHandle_t task)
+{
+	portENTER_CRITICAL(&lock);
+	flusher = task;
+	portEXIT_CRITICAL(&lock);
+}
+
+static const char *const events[] = { "transfer", "retry", "bus recovery" };
+
+static void print(const i2c_log_record_t *r)
+{
+	const char *err = esp_err_to_name(r->res);
+	int64_t ms = r->time_us / 1000;
+
+	if (r->arg == I2C_LOG_ARG_REPEATS)
+	{
+		ESP_LOGW(TAG, "Device [0x%02x at %d] %s: %s repeated %"PRIu32" times", r->addr, r->port,
+			events[r->event], err, r->suppressed);
+		return;
+	}
+
+	switch (r->event) {
+	case I2C_LOG_XFER:
+		ESP_LOGE(TAG, "Transfer to device [0x%02x at %d] failed: %s (at %"PRId64" ms)", r->addr, r->port, err, ms);
+		break;
+	case I2C_LOG_RETRY:
+		ESP_LOGW(TAG, "Transfer to device [0x%02x at %d] failed: %s, recovering bus (retry %u, at %"PRId64" ms)",
+			r->addr, r->port, err, r->arg, ms);
+		break;
+	case I2C_LOG_RECOVER:
+		ESP_LOGE(TAG, "Bus recovery on port %d failed: %s (at %"PRId64" ms)", r->port, err, ms);
+		break;
+	}
+	if (r->suppressed)
+		ESP_LOGW(TAG, "  %"PRIu32" more in the window before", r->suppressed);
+}
+
+// Formats the queued records. Windows that ended with unreported repeats are
+// summarised first.
+void i2c_log_flush(void)
+{
+	int64_t now = i2c_dev_get_backend()->now_us();
+
+	portENTER_CRITICAL(&lock);
+	for (int i = 0; i < I2C_LOG_KEYS; i++)
+	{
+		if (now - keys[i].window_us >= I2C_LOG_WINDOW_US) flush_repeats(&keys[i], now);
+	}
+	uint32_t dropped = lost;
+	lost = 0;
+	portEXIT_CRITICAL(&lock);
+
+	while (1) {
+		portENTER_CRITICAL(&lock);
+		if (!count)
+		{
+			portEXIT_CRITICAL(&lock);
+			break;
+		}
+		i2c_log_record_t r = ring[head];
+		head = (head + 1) % I2C_LOG_RING;
+		count--;
+		portEXIT_CRITICAL(&lock);
+
+		print(&r);
+	}
+	if (dropped) ESP_LOGW(TAG, "%"PRIu32" error records lost, raise I2C_LOG_RING", dropped);
+}
+
+// When the first window with unreported repeats ends, in now_us() time, so
+// the flusher can wake for its summary on an otherwise quiet bus. -1 if none.
+int64_t i2c_log_next_flush_us(void)
+{
+	int64_t due = -1;
+
+	portENTER_CRITICAL(&lock);
+	for (int i = 0; i < I2C_LOG_KEYS; i++)
+	{
+		if (!keys[i].used || !keys[i].suppressed) continue;
+		int64_t end = keys[i].window_us + I2C_LOG_WINDOW_US;
+		if (due < 0 || end < due) due = end;
+	}
+	portEXIT_CRITICAL(&lock);
+	return due;
+}
@@ -0,0 +1,32 @@
+#ifndef MAIN_I2CDEV_LOG_H_
+#define MAIN_I2CDEV_LOG_H_
+
+#include "i2cdev.h"
+
+#define I2C_LOG_WINDOW_US 10000000	// each (device, event, error) is reported once per window
+#define I2C_LOG_KEYS 8				// distinct (device, event, error) tracked at once
+#define I2C_LOG_RING 16				// records waiting to be formatted
+
+typedef enum {
+	I2C_LOG_XFER,		// transaction failed after all retries
+	I2C_LOG_RETRY,		// transaction failed, bus recovered and retried
+	I2C_LOG_RECOVER,	// bus recovery failed
+} i2c_log_event_t;
+
+// Error record as queued on the hot path. Nothing is formatted until
+// i2c_log_flush() runs.
+typedef struct {
+	int64_t time_us;
+	esp_err_t res;
+	uint32_t suppressed;	// repeats not reported in the window before this record
+	uint8_t port;
+	uint8_t addr;
+	uint8_t event;
+	uint8_t arg;			// retry number for I2C_LOG_RETRY
+} i2c_log_record_t;
+
+void i2c_log_error(const i2c_dev_t *dev, i2c_log_event_t event, esp_err_t res, uint8_t arg);
+void i2c_log_set_flusher(TaskHandle_t task);
+void i2c_log_flush(void);
+int64_t i2c_log_next_flush_us(void);
+#endif /* MAIN_I2CDEV_LOG_H_ */
@@ -0,0 +1,175 @@
+#include <string.h>
+#include <time.h>
+
+#include "i2cdev.h"
+#include "i2cdev_sim.h"
+
+// Host implementation of the i2cdev backend. Transactions are routed to
+// simulated targets by address and cost the bus time they would take at the
+// device's clk_speed. That time is not slept; it is added to the virtual
+// clock the targets see, which otherwise follows the host monotonic clock.
+
+static i2c_sim_device_t *devices[I2C_SIM_MAX_DEVICES];
+static i2c_sim_device_t absent;		// handle of a device nobody answers for
+static int64_t offset_us;
+static i2c_sim_stats_t stats;
+static int sim_bus;
+static unsigned faults;		// transactions still to fail
+static esp_err_t fault_res;
+
+esp_err_t i2c_sim_attach(i2c_sim_device_t *sim)
+{
+	for (int i = 0; i < I2C_SIM_MAX_DEVICES; i++)
+	{
+		if (devices[i]) continue;
+		devices[i] = sim;
+		return ESP_OK;
+	}
+	return ESP_ERR_NO_MEM;
+}
+
+int64_t i2c_sim_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + offset_us;
+}
+
+void i2c_sim_advance_us(int64_t us)
+{
+	offset_us += us;
+}
+
+void i2c_sim_get_stats(i2c_sim_stats_t *out)
+{
+	*out = stats;
+}
+
+void i2c_sim_reset_stats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+// The next 'count' transactions fail with 'res' after costing their bus time,
+// as if the target stopped answering or held SDA low.
+void i2c_sim_inject_faults(unsigned count, esp_err_t res)
+{
+	faults = count;
+	fault_res = res;
+}
+
+// SCL periods of one phase: address byte plus payload, 9 clocks each with ACK
+static uint32_t phase_clks(size_t size)
+{
+	return 9 * (1 + size);
+}
+
+static uint32_t clks_to_us(uint32_t clks, uint32_t clk_speed)
+{
+	return ((uint64_t)clks * 1000000 + clk_speed - 1) / clk_speed;
+}
+
+static esp_err_t sim_bus_init(i2c_port_t port, int sda, int scl, void **bus)
+{
+	*bus = &sim_bus;
+	return ESP_OK;
+}
+
+static esp_err_t sim_bus_del(void *bus)
+{
+	return ESP_OK;
+}
+
+static esp_err_t sim_add(void *bus, i2c_dev_t *dev)
+{
+	dev->handle = &absent;
+	for (int i = 0; i < I2C_SIM_MAX_DEVICES; i++)
+	{
+		if (devices[i] && devices[i]->addr == dev->addr) dev->handle = devices[i];
+	}
+	return ESP_OK;
+}
+
+static esp_err_t sim_remove(i2c_dev_t *dev)
+{
+	return ESP_OK;
+}
+
+static esp_err_t sim_set_speed(void *bus, i2c_dev_t *dev, uint32_t hz)
+{
+	dev->clk_speed = hz;
+	return ESP_OK;
+}
+
+static esp_err_t sim_transfer(const i2c_dev_xfer_t *xfer)
+{
+	i2c_sim_device_t *sim = xfer->dev->handle;
+	uint32_t clk_speed = xfer->dev->clk_speed;
+	int64_t now = i2c_sim_now_us();
+	uint32_t clks = 2;	// START and STOP
+	esp_err_t res = ESP_OK;
+
+	stats.transactions++;
+	if (faults)
+	{
+		faults--;
+		clks += phase_clks(0);
+		stats.faults++;
+		res = fault_res;
+	}
+	else if (sim == &absent)
+	{
+		clks += phase_clks(0);
+		stats.nacks++;
+		res = ESP_ERR_INVALID_STATE;
+	}
+	else
+	{
+		uint8_t out[1 + I2CDEV_READV_MAX_BYTES];
+		size_t out_size = xfer->out_reg_size + (xfer->in_data ? 0 : xfer->out_size);
+		if (out_size > sizeof(out)) return ESP_ERR_INVALID_SIZE;
+		if (xfer->out_reg_size) memcpy(out, xfer->out_reg, xfer->out_reg_size);
+		if (!xfer->in_data) memcpy(out + xfer->out_reg_size, xfer->out_data, xfer->out_size);
+
+		if (out_size)
+		{
+			clks += phase_clks(out_size);
+			res = sim->write(sim, out, out_size, now);
+			stats.bytes += out_size;
+		}
+		if (res == ESP_OK && xfer->in_data)
+		{
+			if (out_size) clks += 1;	// repeated START
+			clks += phase_clks(xfer->in_size);
+			res = sim->read(sim, xfer->in_data, xfer->in_size, now + clks_to_us(clks, clk_speed));
+			stats.bytes += xfer->in_size;
+		}
+	}
+
+	uint32_t bus_us = clks_to_us(clks, clk_speed);
+	offset_us += bus_us;
+	stats.bus_time_us += bus_us;
+	stats.last_bus_time_us = bus_us;
+	return res;
+}
+
+// Nine clock pulses and a STOP
+static esp_err_t sim_recover(void *bus)
+{
+	uint32_t bus_us = clks_to_us(9 + 1, 100000);
+	offset_us += bus_us;
+	stats.bus_time_us += bus_us;
+	stats.recoveries++;
+	return ESP_OK;
+}
+
+const i2c_dev_backend_t i2c_dev_sim_backend = {
+	.bus_init = sim_bus_init,
+	.bus_del = sim_bus_del,
+	.add = sim_add,
+	.remove = sim_remove,
+	.set_speed = sim_set_speed,
+	.transfer = sim_transfer,
+	.recover = sim_recover,
+	.now_us = i2c_sim_now_us,
+};
@@ -0,0 +1,34 @@
+#ifndef MAIN_I2CDEV_SIM_H_
+#define MAIN_I2CDEV_SIM_H_
+
+#include "i2cdev.h"
+
+#define I2C_SIM_MAX_DEVICES 4
+
+// A simulated target. write() receives the whole write phase, register
+// pointer first; read() serves the read phase. Both get the virtual time at
+// which the phase starts.
+typedef struct i2c_sim_device i2c_sim_device_t;
+struct i2c_sim_device {
+	uint8_t addr;
+	esp_err_t (*write)(i2c_sim_device_t *sim, const uint8_t *data, size_t size, int64_t now_us);
+	esp_err_t (*read)(i2c_sim_device_t *sim, uint8_t *data, size_t size, int64_t now_us);
+};
+
+typedef struct {
+	uint32_t transactions;
+	uint32_t nacks;
+	uint64_t bytes;
+	uint64_t bus_time_us;	// modelled time on the wire, all transactions
+	uint32_t last_bus_time_us;	// modelled time of the most recent transaction
+	uint32_t faults;		// transactions failed by i2c_sim_inject_faults()
+	uint32_t recoveries;
+} i2c_sim_stats_t;
+
+esp_err_t i2c_sim_attach(i2c_sim_device_t *sim);
+int64_t i2c_sim_now_us(void);
+void i2c_sim_advance_us(int64_t us);
+void i2c_sim_get_stats(i2c_sim_stats_t *stats);
+void i2c_sim_reset_stats(void);
+void i2c_sim_inject_faults(unsigned count, esp_err_t res);
+#endif /* MAIN_I2CDEV_SIM_H_ */
@@ -0,0 +1,214 @@
+#include <string.h>
+#include <inttypes.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_console.h"
+#endif
+
+#include "i2cdev_stats.h"
+
+#define TAG "I2CSTATS"
+
+static i2c_stats_slot_t slots[I2C_STATS_SLOTS];
+static size_t used;
+static uint32_t dropped;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint16_t xfer_reg(const i2c_dev_xfer_t *xfer)
+{
+	return xfer->out_reg_size ? *(const uint8_t *)xfer->out_reg : I2C_STATS_NO_REG;
+}
+
+// caller holds the lock
+static i2c_stats_slot_t *slot_get(const i2c_dev_xfer_t *xfer)
+{
+	uint16_t reg = xfer_reg(xfer);
+
+	for (size_t i = 0; i < used; i++)
+	{
+		if (slots[i].addr == xfer->dev->addr && slots[i].reg == reg && slots[i].port == xfer->dev->port)
+			return &slots[i];
+	}
+	if (used == I2C_STATS_SLOTS)
+	{
+		dropped++;
+		return NULL;
+	}
+	i2c_stats_slot_t *slot = &slots[used++];
+	slot->port = xfer->dev->port;
+	slot->addr = xfer->dev->addr;
+	slot->reg = reg;
+	return slot;
+}
+
+static unsigned bucket(uint32_t us)
+{
+	unsigned b = 0;
+	while (us > 1 && b < I2C_STATS_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	return b;
+}
+
+void i2c_stats_record(const i2c_dev_xfer_t *xfer, esp_err_t res, int64_t start_us, int64_t end_us)
+{
+	uint32_t us = end_us > start_us ? end_us - start_us : 0;
+
+	portENTER_CRITICAL(&lock);
+	i2c_stats_slot_t *slot = slot_get(xfer);
+	if (slot)
+	{
+		slot->count++;
+		slot->total_us += us;
+		if (us > slot->max_us) slot->max_us = us;
+		slot->hist[bucket(us)]++;
+		switch (res) {
+		case ESP_OK:
+			slot->bytes += xfer->out_reg_size + (xfer->in_data ? xfer->in_size : xfer->out_size);
+			break;
+		case ESP_ERR_TIMEOUT:
+			slot->timeouts++;
+			break;
+		case ESP_ERR_INVALID_STATE:		// i2c_master reports a NACK this way
+		case ESP_ERR_INVALID_RESPONSE:
+		case ESP_ERR_NOT_FOUND:
+			slot->nacks++;
+			break;
+		default:
+			slot->errors++;
+			break;
+		}
+	}
+	portEXIT_CRITICAL(&lock);
+}
+
+void i2c_stats_record_coalesced(const i2c_dev_xfer_t *xfer)
+{
+	portENTER_CRITICAL(&lock);
+	i2c_stats_slot_t *slot = slot_get(xfer);
+	if (slot) slot->coalesced++;
+	portEXIT_CRITICAL(&lock);
+}
+
+// Returns the bytes written, the size needed when buf is NULL, or 0 when buf
+// is too small.
+size_t i2c_stats_dump(void *buf, size_t size)
+{
+	portENTER_CRITICAL(&lock);
+	size_t n = used;
+	size_t need = sizeof(i2c_stats_header_t) + n * sizeof(i2c_stats_slot_t);
+	if (buf && size >= need)
+	{
+		i2c_stats_header_t header = {
+			.magic = I2C_STATS_MAGIC,
+			.version = I2C_STATS_VERSION,
+			.slots = n,
+			.dropped = dropped,
+		};
+		memcpy(buf, &header, sizeof(header));
+		memcpy((uint8_t *)buf + sizeof(header), slots, n * sizeof(i2c_stats_slot_t));
+	}
+	portEXIT_CRITICAL(&lock);
+
+	if (!buf) return need;
+	return size >= need ? need : 0;
+}
+
+void i2c_stats_print(void)
+{
+	i2c_stats_slot_t snap[I2C_STATS_SLOTS];
+
+	portENTER_CRITICAL(&lock);
+	size_t n = used;
+	memcpy(snap, slots, n * sizeof(snap[0]));
+	portEXIT_CRITICAL(&lock);
+
+	for (size_t i = 0; i < n; i++)
+	{
+		i2c_stats_slot_t *s = &snap[i];
+		char reg[5];
+		if (s->reg == I2C_STATS_NO_REG) strcpy(reg, "--");
+		else snprintf(reg, sizeof(reg), "%02x", s->reg);
+		ESP_LOGI(TAG, "[0x%02x at %d] reg %s: %"PRIu32" xfers, avg %"PRIu64" us, max %"PRIu32" us, %"PRIu64" bytes, "
+			"%"PRIu32" nack, %"PRIu32" timeout, %"PRIu32" err, %"PRIu32" coalesced",
+			s->addr, s->port, reg, s->count, s->count ? s->total_us / s->count : 0, s->max_us, s->bytes,
+			s->nacks, s->timeouts, s->errors, s->coalesced);
+
+		char line[I2C_STATS_BUCKETS * 12];
+		size_t len = 0;
+		for (unsigned b = 0; b < I2C_STATS_BUCKETS; b++)
+		{
+			if (s->hist[b])
+				len += snprintf(line + len, sizeof(line) - len, " %uus:%"PRIu32, 1u << b, s->hist[b]);
+		}
+		ESP_LOGI(TAG, "  histogram%s", len ? line : " empty");
+	}
+	if (dropped) ESP_LOGW(TAG, "%"PRIu32" transactions not tracked, raise I2C_STATS_SLOTS", dropped);
+}
+
+void i2c_stats_reset(void)
+{
+	portENTER_CRITICAL(&lock);
+	memset(slots, 0, sizeof(slots));
+	used = 0;
+	dropped = 0;
+	portEXIT_CRITICAL(&lock);
+}
+
+#if !CONFIG_IDF_TARGET_LINUX
+static int cmd_i2cstats(int argc, char **argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "reset"))
+	{
+		i2c_stats_reset();
+		return 0;
+	}
+	if (argc > 1 && !strcmp(argv[1], "raw"))
+	{
+		static uint8_t buf[sizeof(i2c_stats_header_t) + sizeof(slots)];
+		size_t len = i2c_stats_dump(buf, sizeof(buf));
+		ESP_LOG_BUFFER_HEX(TAG, buf, len);
+		return 0;
+	}
+	i2c_stats_print();
+	return 0;
+}
+
+esp_err_t i2c_stats_console_start(void)
+{
+	esp_console_repl_t *repl = NULL;
+	esp_console_repl_config_t repl_config = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
+	repl_config.prompt = "watch>";
+
+	esp_err_t res;
+#if defined(CONFIG_ESP_CONSOLE_UART_DEFAULT) || defined(CONFIG_ESP_CONSOLE_UART_CUSTOM)
+	esp_console_dev_uart_config_t hw_config = ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
+	res = esp_console_new_repl_uart(&hw_config, &repl_config, &repl);
+#elif defined(CONFIG_ESP_CONSOLE_USB_SERIAL_JTAG)
+	esp_console_dev_usb_serial_jtag_config_t hw_config = ESP_CONSOLE_DEV_USB_SERIAL_JTAG_CONFIG_DEFAULT();
+	res = esp_console_new_repl_usb_serial_jtag(&hw_config, &repl_config, &repl);
+#else
+	res = ESP_ERR_NOT_SUPPORTED;
+#endif
+	if (res != ESP_OK) return res;
+
+	const esp_console_cmd_t cmd = {
+		.command = "i2cstats",
+		.help = "I2C latency histograms and error counters. 'raw' dumps them in binary, 'reset' clears them",
+		.hint = "[raw|reset]",
+		.func = cmd_i2cstats,
+	};
+	res = esp_console_cmd_register(&cmd);
+	if (res != ESP_OK) return res;
+	return esp_console_start_repl(repl);
+}
+#else
+esp_err_t i2c_stats_console_start(void)
+{
+	return ESP_ERR_NOT_SUPPORTED;
+}
+#endif
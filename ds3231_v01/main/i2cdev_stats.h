@@ -0,0 +1,43 @@
+#ifndef MAIN_I2CDEV_STATS_H_
+#define MAIN_I2CDEV_STATS_H_
+
+#include "i2cdev.h"
+
+#define I2C_STATS_SLOTS 16			// tracked (port, device, register) triples
+#define I2C_STATS_BUCKETS 16		// bucket n counts latencies in [2^n, 2^(n+1)) us
+#define I2C_STATS_NO_REG 0x100		// transactions without a register phase
+#define I2C_STATS_MAGIC 0x53433249	// "I2CS"
+#define I2C_STATS_VERSION 1
+#define I2C_STATS_CONSOLE 0			// register the "i2cstats" console command and start a REPL
+
+typedef struct {
+	uint8_t port;
+	uint8_t addr;
+	uint16_t reg;
+	uint32_t count;
+	uint32_t nacks;
+	uint32_t timeouts;
+	uint32_t errors;		// failures other than NACK and timeout
+	uint32_t coalesced;		// reads answered from another transaction's data
+	uint32_t max_us;
+	uint64_t total_us;
+	uint64_t bytes;
+	uint32_t hist[I2C_STATS_BUCKETS];
+} i2c_stats_slot_t;
+
+// Binary dump: this header followed by 'slots' i2c_stats_slot_t records, in
+// the native byte order of the chip.
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t slots;
+	uint32_t dropped;		// transactions that found no free slot
+} i2c_stats_header_t;
+
+void i2c_stats_record(const i2c_dev_xfer_t *xfer, esp_err_t res, int64_t start_us, int64_t end_us);
+void i2c_stats_record_coalesced(const i2c_dev_xfer_t *xfer);
+size_t i2c_stats_dump(void *buf, size_t size);
+void i2c_stats_print(void);
+void i2c_stats_reset(void);
+esp_err_t i2c_stats_console_start(void);
+#endif /* MAIN_I2CDEV_STATS_H_ */
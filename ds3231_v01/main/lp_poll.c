@@ -0,0 +1,104 @@
+#include <math.h>
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+
+#include "i2cdev.h"
+#include "lp_poll.h"
+
+#if CONFIG_ULP_COPROC_TYPE_LP_CORE
+#include "ulp_lp_core.h"
+#include "lp_core_i2c.h"
+#include "ulp_lp_poll.h"
+
+#define TAG "LP_POLL"
+
+extern const uint8_t lp_poll_bin_start[] asm("_binary_ulp_lp_poll_bin_start");
+extern const uint8_t lp_poll_bin_end[] asm("_binary_ulp_lp_poll_bin_end");
+
+static lp_poll_shared_t *const shared = (lp_poll_shared_t *)&ulp_shared;
+RTC_DATA_ATTR static bool started;	// the LP core keeps running through deep sleep
+
+// Loads the LP program and starts its timer. After a deep-sleep wake the LP
+// core is still polling, so this returns at once.
+esp_err_t lp_poll_start(float temp_lo, float temp_hi)
+{
+	if (started) return ESP_OK;
+
+	lp_core_i2c_cfg_t i2c_cfg = LP_CORE_I2C_DEFAULT_CONFIG();
+	i2c_cfg.i2c_timing_cfg.clk_speed_hz = I2C_FREQ_HZ;
+	esp_err_t res = lp_core_i2c_master_init(LP_I2C_NUM_0, &i2c_cfg);
+	if (res != ESP_OK) return res;
+
+	res = ulp_lp_core_load_binary(lp_poll_bin_start, lp_poll_bin_end - lp_poll_bin_start);
+	if (res != ESP_OK) return res;
+	shared->temp_lo = lroundf(temp_lo * 4);
+	shared->temp_hi = lroundf(temp_hi * 4);
+
+	ulp_lp_core_cfg_t cfg = {
+		.wakeup_source = ULP_LP_CORE_WAKEUP_SOURCE_LP_TIMER,
+		.lp_timer_sleep_duration_us = LP_POLL_PERIOD_US,
+	};
+	res = ulp_lp_core_run(&cfg);
+	if (res != ESP_OK) return res;
+
+	ESP_LOGI(TAG, "Polling DS3231 on the LP core every %d ms", LP_POLL_PERIOD_US / 1000);
+	started = true;
+	return ESP_OK;
+}
+
+bool lp_poll_running(void)
+{
+	return started;
+}
+
+// A reason the LP core adds between the read and the clear is lost, but the
+// sample that caused it is still in the ring.
+uint32_t lp_poll_take_wake_reason(void)
+{
+	uint32_t reason = shared->wake_reason;
+	shared->wake_reason = 0;
+	return reason;
+}
+
+bool lp_poll_read(lp_poll_sample_t *sample)
+{
+	uint32_t tail = shared->tail;
+	if (tail == shared->head) return false;
+
+	*sample = shared->samples[tail % LP_POLL_SLOTS];
+	shared->tail = tail + 1;	// hand the slot back after it is copied
+	return true;
+}
+
+uint32_t lp_poll_overruns(void)
+{
+	return shared->overruns;
+}
+#else
+esp_err_t lp_poll_start(float temp_lo, float temp_hi)
+{
+	return ESP_ERR_NOT_SUPPORTED;
+}
+
+bool lp_poll_running(void)
+{
+	return false;
+}
+
+uint32_t lp_poll_take_wake_reason(void)
+{
+	return 0;
+}
+
+bool lp_poll_read(lp_poll_sample_t *sample)
+{
+	return false;
+}
+
+uint32_t lp_poll_overruns(void)
+{
+	return 0;
+}
+#endif
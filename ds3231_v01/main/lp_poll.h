@@ -0,0 +1,21 @@
+#ifndef MAIN_LP_POLL_H_
+#define MAIN_LP_POLL_H_
+
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "ulp/lp_poll_shared.h"
+
+// The LP I2C controller of the ESP32-C6 is routed to fixed pins.
+#define LP_POLL_SDA_GPIO 6
+#define LP_POLL_SCL_GPIO 7
+
+// DS3231 polling on the LP core. lp_poll_start() loads and starts the LP
+// program once per power-on; after that the HP core sleeps until the LP core
+// wakes it and drains the buffered samples with lp_poll_read().
+esp_err_t lp_poll_start(float temp_lo, float temp_hi);
+bool lp_poll_running(void);
+uint32_t lp_poll_take_wake_reason(void);
+bool lp_poll_read(lp_poll_sample_t *sample);
+uint32_t lp_poll_overruns(void);
+#endif /* MAIN_LP_POLL_H_ */
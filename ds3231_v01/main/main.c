@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <inttypes.h>
 #include <sys/time.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -10,16 +12,20 @@
 #include "esp_log.h"
 #include "esp_attr.h"
 #include "esp_sleep.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
-#include "protocol_examples_common.h"
-#include "esp_sntp.h"
 
+#include "ble_cts.h"
 #include "ds3231.h"
-
-#if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0))
-#define sntp_setoperatingmode esp_sntp_setoperatingmode
-#define sntp_setservername esp_sntp_setservername
-#define sntp_init esp_sntp_init
+#include "ds3231_cal.h"
+#include "tz.h"
+#include "i2cdev_stats.h"
+#include "lp_poll.h"
+#include "sys_clock.h"
+#include "watch_time.h"
+#if TIME_SYNC_WIFI
+#include "ntp_sync.h"
+#include "wifi_fast.h"
 #endif
 
 #if CONFIG_SET_CLOCK
@@ -35,59 +41,300 @@
 static const char *TAG = "DS3213";
 
 RTC_DATA_ATTR static int boot_count = 0;
+RTC_DATA_ATTR static time_t next_sync;	// 0 until the first sync is scheduled
+RTC_DATA_ATTR static int sync_failures;	// in a row, for the retry backoff
+RTC_DATA_ATTR static int phone_misses;	// scheduled syncs in a row the phone was not there for
+
+#define FAIL_SLEEP_SEC 60
+#define CLOCK_MAX_FAILURES 5
+
+// Poll the RTC from the LP core instead of waking the HP core every second.
+// The LP I2C controller has fixed pins, so the DS3231 has to be wired there.
+#if CONFIG_ULP_COPROC_TYPE_LP_CORE && CONFIG_SDA_GPIO == LP_POLL_SDA_GPIO && CONFIG_SCL_GPIO == LP_POLL_SCL_GPIO
+#define LP_POLL 1
+#else
+#define LP_POLL 0
+#endif
+// Otherwise sleep between DS3231 alarms instead of polling every second. The
+// INT/SQW output is open drain and needs a pull-up; most modules fit one.
+// The pin carries either the alarm or the 1 Hz square wave the sub-second
+// phase lock (watch_time.h) runs on: with ALARM_WAKE that lock only runs
+// while a sync measures the RTC, getClock() keeps it all the time.
+#define ALARM_WAKE 1
+#define ALARM_INT_GPIO 4		// only LP IOs (GPIO0-7) can wake the C6 from deep sleep
+#define ALARM_FALLBACK_SEC 120	// timer wake in case INT/SQW is not wired
+#define SQW_GPIO ALARM_INT_GPIO	// getClock() runs INT/SQW as a 1 Hz square wave, alarmClock() while it syncs
+#define LP_POLL_TEMP_LO 0.0		// deg Cel, leaving [LO, HI] wakes the HP core
+#define LP_POLL_TEMP_HI 40.0
+#define CAL_INTERVAL_SEC (6*60*60)	// diffClock: drift sample period
+#define SYNC_ERROR_BUDGET_MS 1000	// largest predicted RTC error kept without a sync
+#define TIME_SYNC_BLE 1			// the phone app writes the time over the Current Time Service
+#ifndef TIME_SYNC_WIFI
+#define TIME_SYNC_WIFI 0		// Wi-Fi and NTP, when the phone did not; set by idf.py -DTIME_SYNC_WIFI=ON
+#endif
+#define BLE_SYNC_WINDOW_MS 4000	// scheduled sync: advertise this long in case the app is open
+#define BLE_SETUP_WINDOW_SEC 60	// the time is lost: give the user time to open the app
+#define BLE_MISSES_BEFORE_WIFI 3	// scheduled syncs go to Wi-Fi after this many without the phone
+#define BLE_ADJUST_SLACK_MS 2000	// scheduled sync: refuse a phone time further off than the predicted RTC error and this
+#define NTP_FALLBACK_SERVERS "pool.ntp.org", "time.google.com", "time.cloudflare.com"	// raced against NTP_SERVER
+#define NTP_TIMEOUT_MS 5000		// wifi_time: wait this long for the first answer
+#define SYNC_TOLERANCE_MS 500	// sync before the predicted RTC error reaches this
+#define SYNC_MIN_INTERVAL_SEC (60*60)			// but no more often
+#define SYNC_MAX_INTERVAL_SEC (7*24*60*60)		// and no less
+#define SYNC_RETRY_SEC (15*60)	// after a failed sync, doubling with each further one
+#define SYNC_RETRY_MAX_SEC (24*60*60)
+#define TZ_NAME ""				// zone from tz_zones.c, "" for a fixed CONFIG_TIMEZONE hour offset
+
+// The RTC keeps UTC; everything shown is local time.
+static tz_t tz;
+
+// The I2C layer has already retried and recovered the bus. Rather than spin
+// with the chip awake, sleep and try again on the next wake.
+static void sleep_after_error(const char *msg)
+{
+	ESP_LOGE(pcTaskGetName(0), "%s Retrying after %d seconds of deep sleep.", msg, FAIL_SLEEP_SEC);
+	esp_deep_sleep(1000000LL * FAIL_SLEEP_SEC);
+}
 
 
-void time_sync_notification_cb(struct timeval *tv)
+// The next sync goes where the drift model predicts the RTC error
+// reaches SYNC_TOLERANCE_MS, within the interval limits.
+static void schedule_sync(time_t now)
 {
-	ESP_LOGI(TAG, "Notification of a time synchronization event");
+	time_t next;
+	ds3231_cal_model_t model = { 0 };
+	if (ds3231_cal_next_sync(SYNC_TOLERANCE_MS * 1000LL, &next, &model) != ESP_OK) next = now;
+	if (next < now + SYNC_MIN_INTERVAL_SEC) next = now + SYNC_MIN_INTERVAL_SEC;
+	if (next > now + SYNC_MAX_INTERVAL_SEC) next = now + SYNC_MAX_INTERVAL_SEC;
+	next_sync = next;
+	if (model.fitted) {
+		ESP_LOGI(TAG, "Drift %.3f ppm + %.4f ppm/C^2, sigma %.3f ppm over %d rates, next sync in %lld s",
+			model.ppm, model.ppm_per_c2, model.sigma_ppm, model.samples, (long long)(next - now));
+	} else {
+		ESP_LOGI(TAG, "No drift model yet (%d rates), next sync in %lld s", model.samples, (long long)(next - now));
+	}
 }
 
-static void initialize_sntp(void)
+// Cold boot without a time sync: if the RTC oscillator never stopped and the error
+// predicted since the last sync is within budget, seed the system clock
+// from the RTC. Returns false when the clock has to be synced.
+static bool seed_from_rtc(void)
 {
-	ESP_LOGI(TAG, "Initializing SNTP");
-	sntp_setoperatingmode(SNTP_OPMODE_POLL);
-	//sntp_setservername(0, "pool.ntp.org");
-	ESP_LOGI(TAG, "Your NTP Server is %s", NTP_SERVER);
-	sntp_setservername(0, NTP_SERVER);
-	sntp_set_time_sync_notification_cb(time_sync_notification_cb);
-	sntp_init();
+	i2c_dev_t dev;
+	if (ds3231_init_desc(&dev, I2C_NUM_0, CONFIG_SDA_GPIO, CONFIG_SCL_GPIO) != ESP_OK) return false;
+
+	bool stopped;
+	esp_err_t res = ds3231_get_oscillator_stop_flag(&dev, &stopped);
+	if (res == ESP_OK && !stopped) res = sys_clock_seed(&dev);
+	ds3231_free_desc(&dev);
+	if (res != ESP_OK) return false;
+	if (stopped) {
+		ESP_LOGW(TAG, "RTC oscillator stopped, the time is lost.");
+		return false;
+	}
+
+	// the clock is only kept when the prediction allows; setClock() sets it
+	// from the phone or over NTP otherwise
+	int64_t error_us;
+	if (nvs_flash_init() != ESP_OK) return false;
+	res = ds3231_cal_predict_error(time(NULL), &error_us);
+	if (res != ESP_OK) {
+		ESP_LOGI(TAG, "No sync record: %s", esp_err_to_name(res));
+		return false;
+	}
+	if (error_us > SYNC_ERROR_BUDGET_MS * 1000LL) {
+		ESP_LOGI(TAG, "Predicted RTC error %"PRId64" ms is over budget.", error_us / 1000);
+		return false;
+	}
+
+	ESP_LOGI(TAG, "System time seeded from the RTC %"PRId64" us after boot, predicted error %"PRId64" ms",
+		esp_timer_get_time(), error_us / 1000);
+	schedule_sync(time(NULL));
+	return true;
 }
 
-static bool obtain_time(void)
+#if TIME_SYNC_WIFI
+static bool wifi_time(void)
 {
-	ESP_ERROR_CHECK( nvs_flash_init() );
-	ESP_ERROR_CHECK( esp_netif_init() );
-	ESP_ERROR_CHECK( esp_event_loop_create_default() );
+	// getClock() syncs again without a reboot in between
+	static bool netif_ready;
+	if (!netif_ready) {
+		ESP_ERROR_CHECK( esp_netif_init() );
+		ESP_ERROR_CHECK( esp_event_loop_create_default() );
+		netif_ready = true;
+	}
 
-	/* This helper function configures Wi-Fi or Ethernet, as selected in menuconfig.
-	 * Read "Establishing Wi-Fi or Ethernet Connection" section in
-	 * examples/protocols/README.md for more information about this function.
-	 */
-	ESP_ERROR_CHECK(example_connect());
+	// Straight to the cached AP and address when there is one, see
+	// wifi_fast.h; example_connect() otherwise.
+	if (wifi_fast_connect() != ESP_OK) return false;
 
-	initialize_sntp();
+	// Ask every server at once and take the first answer; the radio goes
+	// down as soon as it is in rather than on a polling tick.
+	static const char *const servers[] = { NTP_SERVER, NTP_FALLBACK_SERVERS };
+	ESP_LOGI(TAG, "Your NTP Server is %s", NTP_SERVER);
+	int winner;
+	int64_t start = esp_timer_get_time();
+	esp_err_t res = ntp_sync(servers, sizeof(servers) / sizeof(servers[0]), NTP_TIMEOUT_MS, &winner);
+
+	int64_t ntp_us = esp_timer_get_time() - start;
+
+	ESP_ERROR_CHECK( wifi_fast_disconnect() );
+	wifi_fast_stats_t wifi;
+	wifi_fast_get_stats(&wifi);
+	ESP_LOGI(TAG, "%s connect %"PRId64" ms, radio on %"PRId64" ms", wifi.cached ? "Cached" : "Full",
+		wifi.connect_us / 1000, wifi.radio_us / 1000);
+	if (res != ESP_OK) {
+		// perhaps the cached address is no longer ours
+		wifi_fast_invalidate();
+		ESP_LOGW(TAG, "No NTP answer: %s", esp_err_to_name(res));
+		return false;
+	}
+	ESP_LOGI(TAG, "Time from %s after %"PRId64" ms", servers[winner], ntp_us / 1000);
+	return true;
+}
+#endif
 
-	// wait for time to be set
-	int retry = 0;
-	const int retry_count = 10;
-	while (sntp_get_sync_status() == SNTP_SYNC_STATUS_RESET && ++retry < retry_count) {
-		ESP_LOGI(TAG, "Waiting for system time to be set... (%d/%d)", retry, retry_count);
-		vTaskDelay(2000 / portTICK_PERIOD_MS);
+#if TIME_SYNC_BLE
+// The phone writes its time once the app has connected, see ble_cts.h. The
+// stack only runs for the window. A phone can only bond while the time is
+// lost, which is when the user is setting the watch up; otherwise the time
+// it sends has to agree with the RTC's, so a stray central that got past
+// the bonding cannot move the clock far.
+static bool phone_time(int window_ms, bool urgent)
+{
+	int64_t max_adjust_us = 0;
+	if (!urgent) {
+		if (ds3231_cal_predict_error(time(NULL), &max_adjust_us) != ESP_OK) max_adjust_us = 0;
+		max_adjust_us += BLE_ADJUST_SLACK_MS * 1000LL;
 	}
 
-	ESP_ERROR_CHECK( example_disconnect() );
-	if (retry == retry_count) return false;
+	ESP_LOGI(TAG, "Waiting %d ms for the phone to send the time.", window_ms);
+	ble_cts_stats_t stats;
+	esp_err_t res = ble_cts_sync(&tz, window_ms, urgent, max_adjust_us, &stats);
+	if (res != ESP_OK) {
+		ESP_LOGW(TAG, "No time from the phone: %s", esp_err_to_name(res));
+		return false;
+	}
+	ESP_LOGI(TAG, "Time from the phone after %"PRId64" ms, clock moved %"PRId64" ms%s", stats.wait_us / 1000,
+		stats.adjust_us / 1000, stats.local_info ? "" : ", without its zone");
 	return true;
 }
+#endif
+
+// Sets the system clock from the phone if it turns up, then over Wi-Fi if
+// that is built in. Scheduled syncs only catch the phone when the app happens
+// to be open, so they advertise briefly and leave Wi-Fi, which costs far
+// more, until the phone has been missed BLE_MISSES_BEFORE_WIFI times. With
+// the time lost ('urgent') both get their full chance. 'source' tells the
+// drift model which one answered.
+static bool obtain_time(bool urgent, ds3231_cal_source_t *source)
+{
+	static bool nvs_ready;
+	if (!nvs_ready) {
+		ESP_ERROR_CHECK( nvs_flash_init() );
+		nvs_ready = true;
+	}
+#if TIME_SYNC_BLE
+	if (phone_time(urgent ? BLE_SETUP_WINDOW_SEC * 1000 : BLE_SYNC_WINDOW_MS, urgent)) {
+		phone_misses = 0;
+		*source = DS3231_CAL_SOURCE_PHONE;
+		return true;
+	}
+	if (!urgent && ++phone_misses < BLE_MISSES_BEFORE_WIFI) return false;
+#endif
+#if TIME_SYNC_WIFI
+	*source = DS3231_CAL_SOURCE_NTP;
+	return wifi_time();
+#else
+	return false;
+#endif
+}
 
+// Writing the seconds register restarts the RTC's countdown chain, so a
+// write right at a system second boundary sets it to about a millisecond.
+static esp_err_t set_rtc(i2c_dev_t *dev)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	time_t next = tv.tv_sec + 1;
+	int wait_ms = (1000000 - tv.tv_usec) / 1000;
+	if (wait_ms > 20) vTaskDelay(pdMS_TO_TICKS(wait_ms - 20));
+	do gettimeofday(&tv, NULL); while (tv.tv_sec < next);
+	return ds3231_set_epoch(dev, tv.tv_sec);
+}
+
+// A scheduled sync: measure the RTC against the new time, which feeds the drift model
+// and the aging trim, and only set the RTC when it is out by more than half
+// the tolerance, so the rate measurement carries on across syncs.
+static void resync(i2c_dev_t *dev)
+{
+	ESP_LOGI(TAG, "Getting the time.");
+	int64_t offset_us;
+	float temp;
+	time_t now;
+	ds3231_cal_source_t source;
+	if (!obtain_time(false, &source)
+		|| ds3231_cal_measure(dev, &offset_us) != ESP_OK
+		|| ds3231_get_temp_float(dev, &temp) != ESP_OK) {
+		// back off while the phone stays away
+		int retry = SYNC_RETRY_MAX_SEC;
+		if (sync_failures < 16 && SYNC_RETRY_SEC << sync_failures < SYNC_RETRY_MAX_SEC) {
+			retry = SYNC_RETRY_SEC << sync_failures;
+		}
+		sync_failures++;
+		ESP_LOGW(TAG, "Sync failed, next try in %d s.", retry);
+		next_sync = time(NULL) + retry;
+		return;
+	}
+	sync_failures = 0;
+	time(&now);
+	ESP_LOGI(TAG, "RTC offset %.3f s at %.2f deg Cel", offset_us / 1e6, temp);
+
+	if (ds3231_cal_record_sync(now, offset_us, temp, false, source) != ESP_OK) {
+		ESP_LOGW(TAG, "Could not store the sync record.");
+	}
+	ds3231_cal_result_t cal;
+	if (ds3231_cal_update(dev, now, offset_us, source, &cal) != ESP_OK) {
+		ESP_LOGW(TAG, "Could not update the drift calibration.");
+	}
+
+	if (llabs(offset_us) > SYNC_TOLERANCE_MS * 500LL) {
+		if (set_rtc(dev) != ESP_OK) {
+			ESP_LOGW(TAG, "Could not set the RTC.");
+		} else {
+			// the square wave moved with the write; without a relock the next
+			// seed would bring the old time back
+			sys_clock_note_set();
+			if (watch_time_relock(dev) != ESP_OK) {
+				ESP_LOGW(TAG, "Lost the square wave, seeding to the second only.");
+			}
+			if (ds3231_cal_record_sync(time(NULL), 0, temp, true, source) != ESP_OK
+				|| ds3231_cal_reset() != ESP_OK) {
+				ESP_LOGW(TAG, "Could not store the sync record.");
+			}
+		}
+	}
+	schedule_sync(now);
+}
+
+static bool sync_due(void)
+{
+	return next_sync && time(NULL) >= next_sync;
+}
+
+static void sync_if_due(i2c_dev_t *dev)
+{
+	if (sync_due()) resync(dev);
+}
 
 void setClock(void *pvParameters)
 {
-	// obtain time over NTP
-	ESP_LOGI(pcTaskGetName(0), "Connecting to WiFi and getting time over NTP.");
-	if(!obtain_time()) {
-		ESP_LOGE(pcTaskGetName(0), "Fail to getting time over NTP.");
-		while (1) { vTaskDelay(1); }
+	// obtain the time from the phone or over NTP
+	ESP_LOGI(pcTaskGetName(0), "Getting the time.");
+	ds3231_cal_source_t source;
+	if(!obtain_time(true, &source)) {
+		boot_count = 0;	// check the RTC again on the next wake
+		sleep_after_error("Fail to getting time.");
 	}
 
 	// update 'now' variable with current time
@@ -95,16 +342,15 @@ void setClock(void *pvParameters)
 	struct tm timeinfo;
 	char strftime_buf[64];
 	time(&now);
-	now = now + (CONFIG_TIMEZONE*60*60);
-	localtime_r(&now, &timeinfo);
+	tz_localtime(&tz, now, &timeinfo);
 	strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
 	ESP_LOGI(pcTaskGetName(0), "The current date/time is: %s", strftime_buf);
 
 	// Initialize RTC
 	i2c_dev_t dev;
 	if (ds3231_init_desc(&dev, I2C_NUM_0, CONFIG_SDA_GPIO, CONFIG_SCL_GPIO) != ESP_OK) {
-		ESP_LOGE(pcTaskGetName(0), "Could not init device descriptor.");
-		while (1) { vTaskDelay(1); }
+		boot_count = 0;	// check the RTC again on the next wake
+		sleep_after_error("Could not init device descriptor.");
 	}
 
 	ESP_LOGD(pcTaskGetName(0), "timeinfo.tm_sec=%d",timeinfo.tm_sec);
@@ -115,68 +361,188 @@ void setClock(void *pvParameters)
 	ESP_LOGD(pcTaskGetName(0), "timeinfo.tm_mon=%d",timeinfo.tm_mon);
 	ESP_LOGD(pcTaskGetName(0), "timeinfo.tm_year=%d",timeinfo.tm_year);
 
-	struct tm time = {
-		.tm_year = timeinfo.tm_year + 1900,
-		.tm_mon  = timeinfo.tm_mon,  // 0-based
-		.tm_mday = timeinfo.tm_mday,
-		.tm_hour = timeinfo.tm_hour,
-		.tm_min  = timeinfo.tm_min,
-		.tm_sec  = timeinfo.tm_sec
-	};
+	// an RTC that kept running, only drifted past the budget, still gives a rate
+	bool stopped;
+	int64_t offset_us;
+	float temp;
+	if (ds3231_get_oscillator_stop_flag(&dev, &stopped) == ESP_OK && !stopped
+		&& ds3231_cal_measure(&dev, &offset_us) == ESP_OK
+		&& ds3231_get_temp_float(&dev, &temp) == ESP_OK) {
+		ESP_LOGI(pcTaskGetName(0), "RTC offset %.3f s", offset_us / 1e6);
+		ds3231_cal_record_sync(now, offset_us, temp, false, source);
+	}
 
-	if (ds3231_set_time(&dev, &time) != ESP_OK) {
-		ESP_LOGE(pcTaskGetName(0), "Could not set time.");
-		while (1) { vTaskDelay(1); }
+	if (set_rtc(&dev) != ESP_OK) {
+		boot_count = 0;	// check the RTC again on the next wake
+		sleep_after_error("Could not set time.");
 	}
 	ESP_LOGI(pcTaskGetName(0), "Set initial date time done");
 
+	// the time is good again; remember when, for the next cold boot
+	if (ds3231_clear_oscillator_stop_flag(&dev) != ESP_OK) {
+		boot_count = 0;	// check the RTC again on the next wake
+		sleep_after_error("Could not clear the oscillator stop flag.");
+	}
+	if (ds3231_get_temp_float(&dev, &temp) != ESP_OK
+		|| ds3231_cal_record_sync(time(&now), 0, temp, true, source) != ESP_OK) {
+		ESP_LOGW(pcTaskGetName(0), "Could not store the sync record.");
+	}
+
+	// the offset just jumped, drift samples taken before are useless
+	if (ds3231_cal_reset() != ESP_OK) {
+		ESP_LOGW(pcTaskGetName(0), "Could not reset the drift samples.");
+	}
+	schedule_sync(now);
+
 	// goto deep sleep
 	const int deep_sleep_sec = 10;
 	ESP_LOGI(pcTaskGetName(0), "Entering deep sleep for %d seconds", deep_sleep_sec);
 	esp_deep_sleep(1000000LL * deep_sleep_sec);
 }
 
+// Logs a UTC time in local time, with milliseconds unless ms < 0.
+static void log_clock(time_t utc, int ms, float temp)
+{
+	struct tm t;
+	tz_localtime(&tz, utc, &t);
+	if (ms < 0) {
+		ESP_LOGI(pcTaskGetName(0), "%04d-%02d-%02d %02d:%02d:%02d, %.2f deg Cel",
+			t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec, temp);
+	} else {
+		ESP_LOGI(pcTaskGetName(0), "%04d-%02d-%02d %02d:%02d:%02d.%03d, %.2f deg Cel",
+			t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec, ms, temp);
+	}
+}
+
 void getClock(void *pvParameters)
 {
 	// Initialize RTC
 	i2c_dev_t dev;
 	if (ds3231_init_desc(&dev, I2C_NUM_0, CONFIG_SDA_GPIO, CONFIG_SCL_GPIO) != ESP_OK) {
-		ESP_LOGE(pcTaskGetName(0), "Could not init device descriptor.");
-		while (1) { vTaskDelay(1); }
+		sleep_after_error("Could not init device descriptor.");
+	}
+
+	// Sub-second seeds from the square wave, without I2C reads
+	if (watch_time_start(&dev, SQW_GPIO) != ESP_OK) {
+		ESP_LOGW(pcTaskGetName(0), "No square wave on GPIO%d, seeding to the second only.", SQW_GPIO);
 	}
 
 	// Initialise the xLastWakeTime variable with the current time.
 	TickType_t xLastWakeTime = xTaskGetTickCount();
 
-	// Get RTC date and time
+	// Get the date and time from the system clock, which only goes to the RTC
+	// to resync, and the temperature once per conversion cycle
+	int failures = 0;
 	while (1) {
 		float temp;
-		struct tm rtcinfo;
+		struct timeval tv;
+
+		if (sys_clock_sync(&dev) != ESP_OK
+			|| gettimeofday(&tv, NULL) != 0
+			|| ds3231_get_temp_at(&dev, tv.tv_sec, &temp) != ESP_OK) {
+			if (++failures >= CLOCK_MAX_FAILURES) sleep_after_error("Could not get time and temperature.");
+			ESP_LOGW(pcTaskGetName(0), "Could not get time and temperature (%d/%d).", failures, CLOCK_MAX_FAILURES);
+			vTaskDelayUntil(&xLastWakeTime, 1000);
+			continue;
+		}
+		failures = 0;
+
+		log_clock(tv.tv_sec, tv.tv_usec / 1000, temp);
+		ds3231_cal_note_temp(temp);
+		sync_if_due(&dev);
+	vTaskDelayUntil(&xLastWakeTime, 1000);
+	}
+}
+
+// getClock() on the LP core: the HP core only runs when the LP program wakes
+// it, logs the samples buffered since and goes back to deep sleep.
+void lpClock(void *pvParameters)
+{
+	if (!lp_poll_running() && lp_poll_start(LP_POLL_TEMP_LO, LP_POLL_TEMP_HI) != ESP_OK) {
+		sleep_after_error("Could not start polling on the LP core.");
+	}
 
-		if (ds3231_get_temp_float(&dev, &temp) != ESP_OK) {
-			ESP_LOGE(pcTaskGetName(0), "Could not get temperature.");
-			while (1) { vTaskDelay(1); }
+	uint32_t reason = lp_poll_take_wake_reason();
+	if (reason & LP_POLL_WAKE_ERROR) ESP_LOGW(pcTaskGetName(0), "LP core could not read the RTC.");
+	if (reason & LP_POLL_WAKE_THRESHOLD) ESP_LOGW(pcTaskGetName(0), "Temperature crossed a threshold.");
+
+	lp_poll_sample_t sample;
+	int corrupt = 0;
+	while (lp_poll_read(&sample)) {
+		// the LP core copies the registers as read, so a bad read shows up here
+		time_t t = ds3231_decode_epoch(sample.time);
+		if (t < 0) {
+			corrupt++;
+			continue;
 		}
+		log_clock(t, -1, sample.temp * 0.25);
+		ds3231_cal_note_temp(sample.temp * 0.25);
+	}
+	if (corrupt) ESP_LOGW(pcTaskGetName(0), "%d samples with an invalid time skipped", corrupt);
+	if (lp_poll_overruns()) ESP_LOGW(pcTaskGetName(0), "%"PRIu32" samples lost", lp_poll_overruns());
 
-		if (ds3231_get_time(&dev, &rtcinfo) != ESP_OK) {
-			ESP_LOGE(pcTaskGetName(0), "Could not get time.");
-			while (1) { vTaskDelay(1); }
+	esp_sleep_enable_ulp_wakeup();
+	esp_deep_sleep_start();
+}
+
+// getClock() without the polling loop: read the RTC once per minute when its
+// alarm 2 pulls INT/SQW low, and deep sleep in between.
+void alarmClock(void *pvParameters)
+{
+	i2c_dev_t dev;
+	if (ds3231_init_desc(&dev, I2C_NUM_0, CONFIG_SDA_GPIO, CONFIG_SCL_GPIO) != ESP_OK) {
+		sleep_after_error("Could not init device descriptor.");
+	}
+
+	// alarm registers survive on the RTC battery, so only set them when the
+	// alarm was not what woke us
+	if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_EXT1) {
+		if (ds3231_set_alarm(&dev, DS3231_ALARM_2, NULL, 0, NULL, DS3231_ALARM2_EVERY_MIN) != ESP_OK
+			|| ds3231_enable_alarm_ints(&dev, DS3231_ALARM_2) != ESP_OK) {
+			sleep_after_error("Could not set the alarm.");
 		}
+	}
 
-		ESP_LOGI(pcTaskGetName(0), "%04d-%02d-%02d %02d:%02d:%02d, %.2f deg Cel", 
-			rtcinfo.tm_year, rtcinfo.tm_mon + 1,
-			rtcinfo.tm_mday, rtcinfo.tm_hour, rtcinfo.tm_min, rtcinfo.tm_sec, temp);
-	vTaskDelayUntil(&xLastWakeTime, 1000);
+	// a new wake, so this reads the RTC once and seeds the system clock
+	float temp;
+	time_t now;
+	if (sys_clock_sync(&dev) != ESP_OK
+		|| ds3231_get_temp_at(&dev, time(&now), &temp) != ESP_OK) {
+		sleep_after_error("Could not get time and temperature.");
+	}
+	log_clock(now, -1, temp);
+	ds3231_cal_note_temp(temp);
+	if (sync_due()) {
+		// INT/SQW is the alarm output in this mode. For the sync it carries
+		// the square wave, so the RTC is measured from its edges instead of
+		// by polling, and then goes back to the alarm.
+		if (watch_time_start(&dev, SQW_GPIO) != ESP_OK) {
+			ESP_LOGW(pcTaskGetName(0), "No square wave on GPIO%d, measuring the RTC by polling.", SQW_GPIO);
+		}
+		resync(&dev);
+		watch_time_stop();
+		if (ds3231_enable_alarm_ints(&dev, DS3231_ALARM_2) != ESP_OK) {
+			sleep_after_error("Could not set the alarm.");
+		}
 	}
+
+	// INT/SQW stays low until the flag is cleared
+	if (ds3231_clear_alarm_flags(&dev, DS3231_ALARM_2) != ESP_OK) {
+		sleep_after_error("Could not clear the alarm.");
+	}
+
+	esp_sleep_enable_ext1_wakeup_io(1ULL << ALARM_INT_GPIO, ESP_EXT1_WAKEUP_ANY_LOW);
+	esp_sleep_enable_timer_wakeup(1000000LL * ALARM_FALLBACK_SEC);
+	esp_deep_sleep_start();
 }
 
 void diffClock(void *pvParameters)
 {
-	// obtain time over NTP
-	ESP_LOGI(pcTaskGetName(0), "Connecting to WiFi and getting time over NTP.");
-	if(!obtain_time()) {
-		ESP_LOGE(pcTaskGetName(0), "Fail to getting time over NTP.");
-		while (1) { vTaskDelay(1); }
+	// obtain the time from the phone or over NTP
+	ESP_LOGI(pcTaskGetName(0), "Getting the time.");
+	ds3231_cal_source_t source;
+	if(!obtain_time(true, &source)) {
+		sleep_after_error("Fail to getting time.");
 	}
 
 	// update 'now' variable with current time
@@ -184,43 +550,54 @@ void diffClock(void *pvParameters)
 	struct tm timeinfo;
 	char strftime_buf[64];
 	time(&now);
-	now = now + (CONFIG_TIMEZONE*60*60);
-	localtime_r(&now, &timeinfo);
+	tz_localtime(&tz, now, &timeinfo);
 	strftime(strftime_buf, sizeof(strftime_buf), "%m-%d-%y %H:%M:%S", &timeinfo);
-	ESP_LOGI(pcTaskGetName(0), "NTP date/time is: %s", strftime_buf);
+	ESP_LOGI(pcTaskGetName(0), "Synced date/time is: %s", strftime_buf);
 
 	// Initialize RTC
 	i2c_dev_t dev;
 	if (ds3231_init_desc(&dev, I2C_NUM_0, CONFIG_SDA_GPIO, CONFIG_SCL_GPIO) != ESP_OK) {
-		ESP_LOGE(pcTaskGetName(0), "Could not init device descriptor.");
-		while (1) { vTaskDelay(1); }
+		sleep_after_error("Could not init device descriptor.");
 	}
 
-	// Get RTC date and time
-	struct tm rtcinfo;
-	if (ds3231_get_time(&dev, &rtcinfo) != ESP_OK) {
-		ESP_LOGE(pcTaskGetName(0), "Could not get time.");
-		while (1) { vTaskDelay(1); }
+	// Get RTC date and time, straight as seconds since the epoch
+	time_t rtcnow;
+	if (ds3231_get_epoch(&dev, &rtcnow) != ESP_OK) {
+		sleep_after_error("Could not get time.");
 	}
-	rtcinfo.tm_year = rtcinfo.tm_year - 1900;
-	rtcinfo.tm_isdst = -1;
-	ESP_LOGD(pcTaskGetName(0), "%04d-%02d-%02d %02d:%02d:%02d", 
-		rtcinfo.tm_year, rtcinfo.tm_mon + 1,
-		rtcinfo.tm_mday, rtcinfo.tm_hour, rtcinfo.tm_min, rtcinfo.tm_sec);
 
-	// update 'rtcnow' variable with current time
-	time_t rtcnow = mktime(&rtcinfo);
-	localtime_r(&rtcnow, &timeinfo);
+	tz_localtime(&tz, rtcnow, &timeinfo);
 	strftime(strftime_buf, sizeof(strftime_buf), "%m-%d-%y %H:%M:%S", &timeinfo);
 	ESP_LOGI(pcTaskGetName(0), "RTC date/time is: %s", strftime_buf);
 
-	// Get the time difference
-	double x = difftime(rtcnow, now);
-	ESP_LOGI(pcTaskGetName(0), "Time difference is: %f", x);
-	
-	while(1) {
-		vTaskDelay(1000);
+	// Get the time difference, to the millisecond at the RTC's second boundary
+	int64_t offset_us;
+	if (ds3231_cal_measure(&dev, &offset_us) != ESP_OK) {
+		sleep_after_error("Could not measure the time difference.");
+	}
+	ESP_LOGI(pcTaskGetName(0), "Time difference is: %f", offset_us / 1e6);
+
+	float temp;
+	if (ds3231_get_temp_float(&dev, &temp) != ESP_OK
+		|| ds3231_cal_record_sync(now, offset_us, temp, false, source) != ESP_OK) {
+		ESP_LOGW(pcTaskGetName(0), "Could not store the sync record.");
+	}
+
+	// Feed the drift fit, which trims the aging offset once it has enough data
+	ds3231_cal_result_t cal;
+	if (ds3231_cal_update(&dev, now, offset_us, source, &cal) != ESP_OK) {
+		sleep_after_error("Could not update the drift calibration.");
+	}
+	ds3231_free_desc(&dev);
+	if (cal.fitted) {
+		ESP_LOGI(pcTaskGetName(0), "Drift %.2f ppm over %d samples, aging offset %d%s",
+			cal.ppm, cal.samples, cal.aging, cal.trimmed ? " (trimmed)" : "");
+	} else {
+		ESP_LOGI(pcTaskGetName(0), "%d drift samples, aging offset %d", cal.samples, cal.aging);
 	}
+
+	ESP_LOGI(pcTaskGetName(0), "Entering deep sleep for %d seconds", CAL_INTERVAL_SEC);
+	esp_deep_sleep(1000000LL * CAL_INTERVAL_SEC);
 }
 
 void app_main()
@@ -229,20 +606,27 @@ void app_main()
 	ESP_LOGI(TAG, "CONFIG_SCL_GPIO = %d", CONFIG_SCL_GPIO);
 	ESP_LOGI(TAG, "CONFIG_SDA_GPIO = %d", CONFIG_SDA_GPIO);
 	ESP_LOGI(TAG, "CONFIG_TIMEZONE= %d", CONFIG_TIMEZONE);
+	tz_init(&tz, tz_find(TZ_NAME), CONFIG_TIMEZONE*60*60);
+	if (TZ_NAME[0] && !tz.zone) ESP_LOGW(TAG, "Unknown zone %s, using CONFIG_TIMEZONE.", TZ_NAME);
 	ESP_LOGI(TAG, "Boot count: %d", boot_count);
 
+#if I2C_STATS_CONSOLE
+	if (i2c_stats_console_start() != ESP_OK)
+		ESP_LOGW(TAG, "Could not start the i2cstats console");
+#endif
+
 #if CONFIG_SET_CLOCK
-	// Set clock & Get clock
-	if (boot_count == 1) {
+	// Set clock & Get clock. Sync only when the RTC cannot be trusted.
+	if (boot_count == 1 && !seed_from_rtc()) {
 		xTaskCreate(setClock, "setClock", 1024*4, NULL, 2, NULL);
 	} else {
-		xTaskCreate(getClock, "getClock", 1024*4, NULL, 2, NULL);
+		xTaskCreate(LP_POLL ? lpClock : ALARM_WAKE ? alarmClock : getClock, "getClock", 1024*4, NULL, 2, NULL);
 	}
 #endif
 
 #if CONFIG_GET_CLOCK
 	// Get clock
-	xTaskCreate(getClock, "getClock", 1024*4, NULL, 2, NULL);
+	xTaskCreate(LP_POLL ? lpClock : ALARM_WAKE ? alarmClock : getClock, "getClock", 1024*4, NULL, 2, NULL);
 #endif
 
 #if CONFIG_DIFF_CLOCK
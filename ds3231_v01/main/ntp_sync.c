@@ -0,0 +1,178 @@
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "ntp_sync.h"
+
+#define TAG "NTP_SYNC"
+#define NTP_UNIX_OFFSET 2208988800LL	// 1900-01-01 to 1970-01-01 in seconds
+#define NTP_MODE_CLIENT 3
+#define NTP_MODE_SERVER 4
+#define NTP_VERSION 4
+#define NTP_LI_ALARM 3					// leap indicator: server not synchronised
+
+// 48 bytes, all fields in network order. Timestamps are seconds since 1900
+// and a 32-bit binary fraction.
+typedef struct {
+	uint8_t li_vn_mode;
+	uint8_t stratum;
+	int8_t poll;
+	int8_t precision;
+	uint32_t root_delay;
+	uint32_t root_dispersion;
+	uint32_t ref_id;
+	uint32_t ref_ts[2];
+	uint32_t orig_ts[2];
+	uint32_t recv_ts[2];
+	uint32_t xmit_ts[2];
+} ntp_packet_t;
+
+// NTP timestamp to microseconds since 1970. Seconds below 2^31 belong to
+// the era starting in 2036.
+static int64_t ntp_to_us(const uint32_t *ts)
+{
+	int64_t sec = ntohl(ts[0]);
+	uint64_t frac = ntohl(ts[1]);
+	if (sec < 0x80000000LL) sec += 0x100000000LL;
+	return (sec - NTP_UNIX_OFFSET) * 1000000 + (int64_t)((frac * 1000000) >> 32);
+}
+
+// Resolves one server. Returns a socket connected to it, -1 if it cannot be
+// reached, which only takes it out of the race.
+static int open_server(const char *server)
+{
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+	struct addrinfo *ai;
+	if (getaddrinfo(server, NTP_PORT, &hints, &ai) != 0 || !ai) {
+		ESP_LOGW(TAG, "Could not resolve %s", server);
+		return -1;
+	}
+
+	int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	return fd;
+}
+
+static bool ask(int fd, const uint32_t *cookie)
+{
+	// the server echoes our transmit timestamp as the originate one; any
+	// unique value does, the system clock may not be set yet
+	ntp_packet_t req = {
+		.li_vn_mode = NTP_VERSION << 3 | NTP_MODE_CLIENT,
+		.xmit_ts = { cookie[0], cookie[1] },
+	};
+	return send(fd, &req, sizeof(req), 0) == sizeof(req);
+}
+
+static bool valid(const ntp_packet_t *res, const uint32_t *cookie)
+{
+	return (res->li_vn_mode & 7) == NTP_MODE_SERVER
+		&& res->li_vn_mode >> 6 != NTP_LI_ALARM
+		&& res->stratum >= 1 && res->stratum <= 15
+		&& res->orig_ts[0] == cookie[0] && res->orig_ts[1] == cookie[1]
+		&& (res->xmit_ts[0] || res->xmit_ts[1]);
+}
+
+esp_err_t ntp_sync(const char *const *servers, int count, int timeout_ms, int *winner)
+{
+	if (!servers || count <= 0 || count > NTP_SYNC_MAX_SERVERS) return ESP_ERR_INVALID_ARG;
+
+	int64_t start = esp_timer_get_time();
+	int64_t deadline = start + timeout_ms * 1000LL;
+	uint32_t cookie[2] = { htonl((uint32_t)(start >> 32)), htonl((uint32_t)start) };
+
+	// Resolving blocks and takes a while. Doing it between the sends would
+	// leave a fast reply unread until the other lookups are done, and its
+	// wait would count as path delay, so resolve all first and then send
+	// back to back.
+	int fds[NTP_SYNC_MAX_SERVERS];
+	int64_t sent[NTP_SYNC_MAX_SERVERS];
+	int asked = 0;
+	for (int i = 0; i < count; i++) fds[i] = open_server(servers[i]);
+	for (int i = 0; i < count; i++)
+	{
+		if (fds[i] < 0) continue;
+		sent[i] = esp_timer_get_time();
+		if (!ask(fds[i], cookie)) {
+			close(fds[i]);
+			fds[i] = -1;
+			continue;
+		}
+		asked++;
+	}
+	if (!asked) return ESP_ERR_NOT_FOUND;
+
+	esp_err_t res = ESP_ERR_TIMEOUT;
+	while (res == ESP_ERR_TIMEOUT)
+	{
+		if (!asked) {
+			res = ESP_ERR_INVALID_RESPONSE;
+			break;
+		}
+		int64_t left = deadline - esp_timer_get_time();
+		if (left <= 0) break;
+
+		fd_set readable;
+		FD_ZERO(&readable);
+		int maxfd = -1;
+		for (int i = 0; i < count; i++)
+		{
+			if (fds[i] < 0) continue;
+			FD_SET(fds[i], &readable);
+			if (fds[i] > maxfd) maxfd = fds[i];
+		}
+		struct timeval tv = { .tv_sec = left / 1000000, .tv_usec = left % 1000000 };
+		int ready = select(maxfd + 1, &readable, NULL, NULL, &tv);
+		if (ready < 0 && errno != EINTR) {
+			ESP_LOGW(TAG, "select failed: %d", errno);
+			res = ESP_FAIL;
+			break;
+		}
+		if (ready <= 0) continue;
+
+		int64_t arrival = esp_timer_get_time();
+		for (int i = 0; i < count && res == ESP_ERR_TIMEOUT; i++)
+		{
+			if (fds[i] < 0 || !FD_ISSET(fds[i], &readable)) continue;
+
+			ntp_packet_t reply;
+			if (recv(fds[i], &reply, sizeof(reply), 0) != sizeof(reply) || !valid(&reply, cookie)) {
+				// a bad answer does not end the race, but that server is out
+				ESP_LOGW(TAG, "Bad reply from %s", servers[i]);
+				close(fds[i]);
+				fds[i] = -1;
+				asked--;
+				continue;
+			}
+
+			// server time at the arrival, by half the round trip spent off the server
+			int64_t t2 = ntp_to_us(reply.recv_ts);
+			int64_t t3 = ntp_to_us(reply.xmit_ts);
+			int64_t delay = (arrival - sent[i]) - (t3 - t2);
+			int64_t now = t3 + delay / 2 + (esp_timer_get_time() - arrival);
+			struct timeval set = { .tv_sec = now / 1000000, .tv_usec = now % 1000000 };
+			if (settimeofday(&set, NULL) != 0) {
+				res = ESP_FAIL;
+				break;
+			}
+			ESP_LOGD(TAG, "%s answered, round trip %"PRId64" us", servers[i], delay);
+			if (winner) *winner = i;
+			res = ESP_OK;
+		}
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		if (fds[i] >= 0) close(fds[i]);
+	}
+	return res;
+}
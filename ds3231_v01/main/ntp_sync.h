@@ -0,0 +1,15 @@
+#ifndef MAIN_NTP_SYNC_H_
+#define MAIN_NTP_SYNC_H_
+
+#include "esp_err.h"
+
+#define NTP_SYNC_MAX_SERVERS 4
+#define NTP_PORT "123"
+
+// SNTP (RFC 4330) against several servers at once: one request goes to each
+// and the first valid reply, corrected for half its round trip, sets the
+// system clock. Blocks on the sockets rather than polling, so it returns as
+// soon as that reply is in, or with ESP_ERR_TIMEOUT after 'timeout_ms'.
+// 'winner', if not NULL, gets the index of the server that answered.
+esp_err_t ntp_sync(const char *const *servers, int count, int timeout_ms, int *winner);
+#endif /* MAIN_NTP_SYNC_H_ */
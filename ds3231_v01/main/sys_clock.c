@@ -0,0 +1,59 @@
+#include <sys/time.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "sys_clock.h"
+#include "watch_time.h"
+
+#define TAG "SYS_CLOCK"
+
+// esp_timer time of the last seed, -1 for none. Deliberately not
+// RTC_DATA_ATTR: a wake from deep sleep seeds again.
+static int64_t seeded_us = -1;
+
+// With the square wave locked its edges give the microseconds and the seed
+// costs no bus traffic. A plain read only gives the second, somewhere inside
+// which; taking its middle halves the worst error.
+esp_err_t sys_clock_seed(i2c_dev_t *dev)
+{
+	if (!dev) return ESP_ERR_INVALID_ARG;
+
+	struct timeval tv;
+	int64_t us = watch_time_now_us();
+	// a gap in the edges drops the lock, this gets it back
+	if (us < 0 && watch_time_relock(dev) == ESP_OK) us = watch_time_now_us();
+	if (us >= 0)
+	{
+		tv.tv_sec = us / 1000000;
+		tv.tv_usec = us % 1000000;
+	}
+	else
+	{
+		time_t epoch;
+		esp_err_t res = ds3231_get_epoch(dev, &epoch);
+		if (res != ESP_OK) return res;
+		tv.tv_sec = epoch;
+		tv.tv_usec = 500000;
+	}
+	if (settimeofday(&tv, NULL) != 0) return ESP_FAIL;
+
+	seeded_us = esp_timer_get_time();
+	ESP_LOGD(TAG, "System time seeded from the RTC: %lld.%06ld", (long long)tv.tv_sec, (long)tv.tv_usec);
+	return ESP_OK;
+}
+
+esp_err_t sys_clock_sync(i2c_dev_t *dev)
+{
+	if (seeded_us >= 0 && esp_timer_get_time() - seeded_us < SYS_CLOCK_RESYNC_SEC * 1000000LL) return ESP_OK;
+	return sys_clock_seed(dev);
+}
+
+void sys_clock_note_set(void)
+{
+	seeded_us = esp_timer_get_time();
+}
+
+bool sys_clock_seeded(void)
+{
+	return seeded_us >= 0;
+}
@@ -0,0 +1,21 @@
+#ifndef MAIN_SYS_CLOCK_H_
+#define MAIN_SYS_CLOCK_H_
+
+#include <stdbool.h>
+
+#include "ds3231.h"
+
+#define SYS_CLOCK_RESYNC_SEC (60*60)	// re-read the RTC this often while awake
+
+// The system clock as the time source. The RTC seeds settimeofday() once per
+// wake; time() and gettimeofday() then run from esp_timer without touching
+// the bus. sys_clock_sync() seeds again once the last seed is
+// SYS_CLOCK_RESYNC_SEC old, and after every deep sleep, whose RC timer keeps
+// far worse time than the RTC. The RTC keeps UTC.
+esp_err_t sys_clock_seed(i2c_dev_t *dev);
+esp_err_t sys_clock_sync(i2c_dev_t *dev);
+// The system clock was set from elsewhere and the RTC from it: both agree,
+// so the next reseed is due SYS_CLOCK_RESYNC_SEC from now.
+void sys_clock_note_set(void);
+bool sys_clock_seeded(void);
+#endif /* MAIN_SYS_CLOCK_H_ */
@@ -0,0 +1,123 @@
+#include <string.h>
+
+#include "tz.h"
+#include "civil.h"
+
+static int32_t floor_days(time_t t)
+{
+	return t / 86400 - (t % 86400 < 0);
+}
+
+const tz_zone_t *tz_find(const char *name)
+{
+	for (size_t i = 0; i < tz_zone_count; i++)
+	{
+		if (!strcmp(tz_zones[i].name, name)) return &tz_zones[i];
+	}
+	return NULL;
+}
+
+// A NULL zone, or one without DST, has one offset for all time.
+void tz_init(tz_t *tz, const tz_zone_t *zone, int32_t fixed_offset)
+{
+	tz->zone = zone;
+	tz->from = TZ_TIME_MIN;
+	tz->until = TZ_TIME_MAX;
+	tz->offset = zone ? zone->std_offset : fixed_offset;
+	tz->dst = false;
+	if (zone && zone->dst_offset != zone->std_offset)
+		tz->until = TZ_TIME_MIN;	// computed on first use
+}
+
+// UTC time of a rule in 'year', 'offset' being the offset it is given in.
+static time_t transition(const tz_rule_t *rule, int32_t year, int32_t offset)
+{
+	int32_t first = days_from_civil(year, rule->month, 1);
+	int32_t day = first + (rule->wday + 7 - weekday_from_days(first)) % 7 + (rule->week - 1) * 7;
+	if (rule->week == 5)
+	{
+		int32_t next = rule->month == 12 ? days_from_civil(year + 1, 1, 1) : days_from_civil(year, rule->month + 1, 1);
+		while (day >= next) day -= 7;
+	}
+	return (time_t)day * 86400 + rule->time - offset;
+}
+
+// Finds the transitions around 'utc' from those of the year before to the
+// year after, which also covers southern zones whose DST spans New Year.
+static void update(tz_t *tz, time_t utc)
+{
+	const tz_zone_t *z = tz->zone;
+	int32_t year;
+	uint32_t month, mday;
+	civil_from_days(floor_days(utc), &year, &month, &mday);
+
+	struct {
+		time_t at;
+		bool dst;
+	} t[6], tmp;
+	int n = 0;
+	for (int32_t y = year - 1; y <= year + 1; y++)
+	{
+		t[n].at = transition(&z->dst_start, y, z->std_offset);
+		t[n++].dst = true;
+		t[n].at = transition(&z->dst_end, y, z->dst_offset);
+		t[n++].dst = false;
+	}
+	for (int i = 1; i < n; i++)
+	{
+		for (int j = i; j > 0 && t[j - 1].at > t[j].at; j--)
+		{
+			tmp = t[j];
+			t[j] = t[j - 1];
+			t[j - 1] = tmp;
+		}
+	}
+
+	int i = 0;
+	while (i < n && t[i].at <= utc) i++;
+	tz->dst = i ? t[i - 1].dst : !t[0].dst;
+	tz->from = i ? t[i - 1].at : TZ_TIME_MIN;
+	tz->until = i < n ? t[i].at : TZ_TIME_MAX;
+	tz->offset = tz->dst ? z->dst_offset : z->std_offset;
+}
+
+int32_t tz_offset(tz_t *tz, time_t utc)
+{
+	if (utc < tz->from || utc >= tz->until) update(tz, utc);
+	return tz->offset;
+}
+
+time_t tz_local(tz_t *tz, time_t utc)
+{
+	return utc + tz_offset(tz, utc);
+}
+
+// Local times in the hour skipped by a DST start do not exist, those in the
+// hour repeated by a DST end exist twice; either way one of the offsets
+// around the transition is used.
+time_t tz_utc(tz_t *tz, time_t local)
+{
+	int32_t offset = tz_offset(tz, local - tz_offset(tz, local));
+	return local - offset;
+}
+
+void tz_localtime(tz_t *tz, time_t utc, struct tm *tm)
+{
+	time_t local = tz_local(tz, utc);
+	int32_t days = floor_days(local);
+	int32_t secs = local - (time_t)days * 86400;
+	int32_t year;
+	uint32_t month, mday;
+	civil_from_days(days, &year, &month, &mday);
+
+	memset(tm, 0, sizeof(*tm));
+	tm->tm_sec = secs % 60;
+	tm->tm_min = secs / 60 % 60;
+	tm->tm_hour = secs / 3600;
+	tm->tm_mday = mday;
+	tm->tm_mon = month - 1;
+	tm->tm_year = year - 1900;
+	tm->tm_wday = weekday_from_days(days);
+	tm->tm_yday = days - days_from_civil(year, 1, 1);
+	tm->tm_isdst = tz->dst;
+}
@@ -0,0 +1,47 @@
+#ifndef MAIN_TZ_H_
+#define MAIN_TZ_H_
+
+#include <time.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TZ_TIME_MIN ((time_t)INT64_MIN)
+#define TZ_TIME_MAX ((time_t)INT64_MAX)
+
+// DST transition, as "Mm.w.d/time" in a POSIX TZ string.
+typedef struct {
+	uint8_t month;	// 1-12
+	uint8_t week;	// 1-4, 5 for the last one in the month
+	uint8_t wday;	// 0 = Sunday
+	int32_t time;	// seconds after midnight, local time in force before the transition
+} tz_rule_t;
+
+typedef struct {
+	const char *name;		// tz database name
+	int32_t std_offset;		// seconds east of UTC
+	int32_t dst_offset;		// while DST is in force, std_offset if there is no DST
+	tz_rule_t dst_start;
+	tz_rule_t dst_end;
+} tz_zone_t;
+
+// A zone and the offset in force over [from, until). Conversions inside that
+// interval cost a compare; only crossing a transition recomputes it.
+typedef struct {
+	const tz_zone_t *zone;	// NULL for a fixed offset
+	time_t from;
+	time_t until;
+	int32_t offset;
+	bool dst;
+} tz_t;
+
+extern const tz_zone_t tz_zones[];
+extern const size_t tz_zone_count;
+
+const tz_zone_t *tz_find(const char *name);
+void tz_init(tz_t *tz, const tz_zone_t *zone, int32_t fixed_offset);
+int32_t tz_offset(tz_t *tz, time_t utc);
+time_t tz_local(tz_t *tz, time_t utc);
+time_t tz_utc(tz_t *tz, time_t local);
+void tz_localtime(tz_t *tz, time_t utc, struct tm *tm);
+#endif /* MAIN_TZ_H_ */
@@ -0,0 +1,70 @@
+#include "tz.h"
+
+// Generated by tools/gen_tz_zones.py from tzdata 2025b, do not edit.
+// Current rules of tz database zones, from the POSIX TZ string at the end of
+// each zone's TZif file. Past rule changes are not kept: the watch only
+// converts times near now. Zones that share rules are listed once per name
+// so tz_find() can take any of them.
+
+#define H 3600
+#define FIXED(off)	.std_offset = (off), .dst_offset = (off)
+
+const tz_zone_t tz_zones[] = {
+	{ "UTC", FIXED(0) },	// UTC0
+	{ "Europe/London", .std_offset = 0, .dst_offset = 1 * H,	// GMT0BST,M3.5.0/1,M10.5.0
+		.dst_start = { 3, 5, 0, 1 * H }, .dst_end = { 10, 5, 0, 2 * H } },
+	{ "Europe/Lisbon", .std_offset = 0, .dst_offset = 1 * H,	// WET0WEST,M3.5.0/1,M10.5.0
+		.dst_start = { 3, 5, 0, 1 * H }, .dst_end = { 10, 5, 0, 2 * H } },
+	{ "Europe/Amsterdam", .std_offset = 1 * H, .dst_offset = 2 * H,	// CET-1CEST,M3.5.0,M10.5.0/3
+		.dst_start = { 3, 5, 0, 2 * H }, .dst_end = { 10, 5, 0, 3 * H } },
+	{ "Europe/Berlin", .std_offset = 1 * H, .dst_offset = 2 * H,	// CET-1CEST,M3.5.0,M10.5.0/3
+		.dst_start = { 3, 5, 0, 2 * H }, .dst_end = { 10, 5, 0, 3 * H } },
+	{ "Europe/Brussels", .std_offset = 1 * H, .dst_offset = 2 * H,	// CET-1CEST,M3.5.0,M10.5.0/3
+		.dst_start = { 3, 5, 0, 2 * H }, .dst_end = { 10, 5, 0, 3 * H } },
+	{ "Europe/Madrid", .std_offset = 1 * H, .dst_offset = 2 * H,	// CET-1CEST,M3.5.0,M10.5.0/3
+		.dst_start = { 3, 5, 0, 2 * H }, .dst_end = { 10, 5, 0, 3 * H } },
+	{ "Europe/Paris", .std_offset = 1 * H, .dst_offset = 2 * H,	// CET-1CEST,M3.5.0,M10.5.0/3
+		.dst_start = { 3, 5, 0, 2 * H }, .dst_end = { 10, 5, 0, 3 * H } },
+	{ "Europe/Rome", .std_offset = 1 * H, .dst_offset = 2 * H,	// CET-1CEST,M3.5.0,M10.5.0/3
+		.dst_start = { 3, 5, 0, 2 * H }, .dst_end = { 10, 5, 0, 3 * H } },
+	{ "Europe/Stockholm", .std_offset = 1 * H, .dst_offset = 2 * H,	// CET-1CEST,M3.5.0,M10.5.0/3
+		.dst_start = { 3, 5, 0, 2 * H }, .dst_end = { 10, 5, 0, 3 * H } },
+	{ "Europe/Warsaw", .std_offset = 1 * H, .dst_offset = 2 * H,	// CET-1CEST,M3.5.0,M10.5.0/3
+		.dst_start = { 3, 5, 0, 2 * H }, .dst_end = { 10, 5, 0, 3 * H } },
+	{ "Europe/Athens", .std_offset = 2 * H, .dst_offset = 3 * H,	// EET-2EEST,M3.5.0/3,M10.5.0/4
+		.dst_start = { 3, 5, 0, 3 * H }, .dst_end = { 10, 5, 0, 4 * H } },
+	{ "Europe/Helsinki", .std_offset = 2 * H, .dst_offset = 3 * H,	// EET-2EEST,M3.5.0/3,M10.5.0/4
+		.dst_start = { 3, 5, 0, 3 * H }, .dst_end = { 10, 5, 0, 4 * H } },
+	{ "Europe/Kyiv", .std_offset = 2 * H, .dst_offset = 3 * H,	// EET-2EEST,M3.5.0/3,M10.5.0/4
+		.dst_start = { 3, 5, 0, 3 * H }, .dst_end = { 10, 5, 0, 4 * H } },
+	{ "Europe/Istanbul", FIXED(3 * H) },	// <+03>-3
+	{ "Europe/Moscow", FIXED(3 * H) },	// MSK-3
+	{ "Asia/Dubai", FIXED(4 * H) },	// <+04>-4
+	{ "Asia/Kolkata", FIXED(5 * H + 1800) },	// IST-5:30
+	{ "Asia/Shanghai", FIXED(8 * H) },	// CST-8
+	{ "Asia/Singapore", FIXED(8 * H) },	// <+08>-8
+	{ "Asia/Tokyo", FIXED(9 * H) },	// JST-9
+	{ "Australia/Brisbane", FIXED(10 * H) },	// AEST-10
+	{ "Australia/Adelaide", .std_offset = 9 * H + 1800, .dst_offset = 10 * H + 1800,	// ACST-9:30ACDT,M10.1.0,M4.1.0/3
+		.dst_start = { 10, 1, 0, 2 * H }, .dst_end = { 4, 1, 0, 3 * H } },
+	{ "Australia/Sydney", .std_offset = 10 * H, .dst_offset = 11 * H,	// AEST-10AEDT,M10.1.0,M4.1.0/3
+		.dst_start = { 10, 1, 0, 2 * H }, .dst_end = { 4, 1, 0, 3 * H } },
+	{ "Pacific/Auckland", .std_offset = 12 * H, .dst_offset = 13 * H,	// NZST-12NZDT,M9.5.0,M4.1.0/3
+		.dst_start = { 9, 5, 0, 2 * H }, .dst_end = { 4, 1, 0, 3 * H } },
+	{ "America/Sao_Paulo", FIXED(-3 * H) },	// <-03>3
+	{ "America/Halifax", .std_offset = -4 * H, .dst_offset = -3 * H,	// AST4ADT,M3.2.0,M11.1.0
+		.dst_start = { 3, 2, 0, 2 * H }, .dst_end = { 11, 1, 0, 2 * H } },
+	{ "America/New_York", .std_offset = -5 * H, .dst_offset = -4 * H,	// EST5EDT,M3.2.0,M11.1.0
+		.dst_start = { 3, 2, 0, 2 * H }, .dst_end = { 11, 1, 0, 2 * H } },
+	{ "America/Chicago", .std_offset = -6 * H, .dst_offset = -5 * H,	// CST6CDT,M3.2.0,M11.1.0
+		.dst_start = { 3, 2, 0, 2 * H }, .dst_end = { 11, 1, 0, 2 * H } },
+	{ "America/Denver", .std_offset = -7 * H, .dst_offset = -6 * H,	// MST7MDT,M3.2.0,M11.1.0
+		.dst_start = { 3, 2, 0, 2 * H }, .dst_end = { 11, 1, 0, 2 * H } },
+	{ "America/Phoenix", FIXED(-7 * H) },	// MST7
+	{ "America/Los_Angeles", .std_offset = -8 * H, .dst_offset = -7 * H,	// PST8PDT,M3.2.0,M11.1.0
+		.dst_start = { 3, 2, 0, 2 * H }, .dst_end = { 11, 1, 0, 2 * H } },
+	{ "America/Anchorage", .std_offset = -9 * H, .dst_offset = -8 * H,	// AKST9AKDT,M3.2.0,M11.1.0
+		.dst_start = { 3, 2, 0, 2 * H }, .dst_end = { 11, 1, 0, 2 * H } },
+	{ "Pacific/Honolulu", FIXED(-10 * H) },	// HST10
+};
+const size_t tz_zone_count = sizeof(tz_zones) / sizeof(tz_zones[0]);
@@ -0,0 +1,82 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ulp_lp_core.h"
+#include "ulp_lp_core_utils.h"
+#include "ulp_lp_core_i2c.h"
+
+#include "lp_poll_shared.h"
+
+// LP core program. The LP timer restarts main() every LP_POLL_PERIOD_US; each
+// run reads the DS3231 over LP I2C, appends a sample to the ring in RTC
+// memory and wakes the HP core only when there is something to act on.
+
+#define DS3231_ADDR 0x68
+#define DS3231_ADDR_TIME 0x00
+#define DS3231_ADDR_STATUS 0x0f
+#define DS3231_ADDR_TEMP 0x11
+#define LP_I2C_TIMEOUT_CYCLES 5000
+
+lp_poll_shared_t shared;	// exported to the HP core as ulp_shared
+
+static uint8_t last_min = 0xff;
+static int8_t last_band;	// -1 below temp_lo, 0 inside, 1 above
+static uint8_t failures;
+static uint16_t seq;
+
+static esp_err_t read_regs(uint8_t reg, uint8_t *data, size_t size)
+{
+	return lp_core_i2c_master_write_read_device(LP_I2C_NUM_0, DS3231_ADDR, &reg, 1, data, size,
+		LP_I2C_TIMEOUT_CYCLES);
+}
+
+static int8_t band(int16_t temp)
+{
+	if (temp < shared.temp_lo) return -1;
+	if (temp > shared.temp_hi) return 1;
+	return 0;
+}
+
+int main(void)
+{
+	lp_poll_sample_t s;
+	uint8_t t[2];
+	uint32_t wake = 0;
+
+	if (read_regs(DS3231_ADDR_TIME, s.time, sizeof(s.time)) != ESP_OK
+		|| read_regs(DS3231_ADDR_STATUS, &s.status, 1) != ESP_OK
+		|| read_regs(DS3231_ADDR_TEMP, t, sizeof(t)) != ESP_OK)
+	{
+		shared.errors++;
+		if (++failures == LP_POLL_MAX_ERRORS) wake |= LP_POLL_WAKE_ERROR;
+	}
+	else
+	{
+		failures = 0;
+		s.temp = (int16_t)(int8_t)t[0] << 2 | t[1] >> 6;
+		s.seq = seq++;
+
+		if (s.time[1] != last_min && last_min != 0xff) wake |= LP_POLL_WAKE_MINUTE;
+		last_min = s.time[1];
+
+		int8_t b = band(s.temp);
+		if (b != last_band) wake |= LP_POLL_WAKE_THRESHOLD;
+		last_band = b;
+
+		uint32_t head = shared.head;
+		if (head - shared.tail < LP_POLL_SLOTS)
+		{
+			shared.samples[head % LP_POLL_SLOTS] = s;
+			shared.head = head + 1;		// publish after the sample is written
+		}
+		else shared.overruns++;
+		if (shared.head - shared.tail == LP_POLL_SLOTS) wake |= LP_POLL_WAKE_FULL;
+	}
+
+	if (wake)
+	{
+		shared.wake_reason |= wake;
+		ulp_lp_core_wakeup_main_processor();
+	}
+	return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef MAIN_ULP_LP_POLL_SHARED_H_
+#define MAIN_ULP_LP_POLL_SHARED_H_
+
+#include <stdint.h>
+
+// Shared between the LP core program (ulp/lp_poll.c) and the HP side
+// (lp_poll.c). Everything here lives in RTC memory and survives deep sleep.
+
+#define LP_POLL_SLOTS 32			// buffered samples, a power of two
+#define LP_POLL_PERIOD_US 1000000	// LP timer period between polls
+
+// Why the LP core woke the HP core; ORed together until the HP core clears them.
+#define LP_POLL_WAKE_MINUTE    0x01	// the minutes register changed
+#define LP_POLL_WAKE_THRESHOLD 0x02	// temperature left or re-entered [temp_lo, temp_hi]
+#define LP_POLL_WAKE_FULL      0x04	// the sample ring is full
+#define LP_POLL_WAKE_ERROR     0x08	// LP I2C reads keep failing
+
+#define LP_POLL_MAX_ERRORS 4		// consecutive failed polls before waking the HP core
+
+typedef struct {
+	uint8_t time[7];	// registers 0x00-0x06 as read, BCD
+	uint8_t status;		// register 0x0f
+	int16_t temp;		// registers 0x11-0x12 in 1/4 degrees Celsius
+	uint16_t seq;		// poll counter, to spot dropped samples
+} lp_poll_sample_t;
+
+// Single-producer ring: the LP core only writes 'head', the HP core only
+// writes 'tail'. Both are free-running and index modulo LP_POLL_SLOTS.
+typedef struct {
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	volatile uint32_t wake_reason;
+	volatile uint32_t overruns;	// samples dropped on a full ring
+	volatile uint32_t errors;	// failed polls since boot
+	volatile int32_t temp_lo;	// 1/4 degrees Celsius
+	volatile int32_t temp_hi;
+	lp_poll_sample_t samples[LP_POLL_SLOTS];
+} lp_poll_shared_t;
+#endif /* MAIN_ULP_LP_POLL_SHARED_H_ */
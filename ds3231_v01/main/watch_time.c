@@ -0,0 +1,180 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/gpio.h"
+
+#include "watch_time.h"
+
+#define TAG "WATCH_TIME"
+#define PERIOD_ONE (1000000LL << 16)	// nominal RTC second in esp_timer us, 16.16 fixed point
+
+// Written by the edge ISR and, while locking on, by watch_time_start().
+static struct {
+	uint32_t edges;		// second boundaries since start, missed edges included
+	int64_t edge_us;	// esp_timer time of the last one
+	int64_t period;		// filtered RTC second in esp_timer us, 16.16
+	uint32_t base_edges;	// edge labelled with base_epoch
+	time_t base_epoch;	// 0 until locked
+} state;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static gpio_num_t gpio = GPIO_NUM_NC;
+
+// Runs from flash: the ISR service is installed without ESP_INTR_FLAG_IRAM,
+// so edges during flash writes are late rather than lost.
+static void sqw_isr(void *arg)
+{
+	int64_t t = esp_timer_get_time();
+
+	portENTER_CRITICAL_ISR(&lock);
+	if (state.edges)
+	{
+		int64_t dt = t - state.edge_us;
+		int64_t period = state.period >> 16;
+		if (dt > WATCH_TIME_MAX_GAP * period)
+		{
+			// too long to count the missed seconds for sure; the labels go
+			// and counting starts over from this edge
+			state.edges = 1;
+			state.base_epoch = 0;
+			state.edge_us = t;
+			portEXIT_CRITICAL_ISR(&lock);
+			return;
+		}
+		uint32_t n = (dt + period / 2) / period;
+		if (!n)
+		{
+			// bounce or glitch, well inside the current second
+			portEXIT_CRITICAL_ISR(&lock);
+			return;
+		}
+		int32_t error = (int32_t)(dt / n) - 1000000;
+		if (error >= -WATCH_TIME_MAX_PPM && error <= WATCH_TIME_MAX_PPM)
+			state.period += (((int64_t)(dt / n) << 16) - state.period) >> WATCH_TIME_RATE_SHIFT;
+		state.edges += n;
+	}
+	else state.edges = 1;
+	state.edge_us = t;
+	portEXIT_CRITICAL_ISR(&lock);
+}
+
+static uint32_t edges(void)
+{
+	portENTER_CRITICAL(&lock);
+	uint32_t n = state.edges;
+	portEXIT_CRITICAL(&lock);
+	return n;
+}
+
+// Waits for an edge and labels it with an RTC read made before the next one.
+static esp_err_t lock_on(i2c_dev_t *dev)
+{
+	esp_err_t res = ESP_OK;
+	for (int waited = 0; waited < WATCH_TIME_LOCK_TIMEOUT_MS; waited += 10)
+	{
+		uint32_t before = edges();
+		if (before)
+		{
+			time_t epoch;
+			res = ds3231_get_epoch(dev, &epoch);
+			if (res != ESP_OK) return res;
+			if (edges() == before)
+			{
+				portENTER_CRITICAL(&lock);
+				state.base_edges = before;
+				state.base_epoch = epoch;
+				portEXIT_CRITICAL(&lock);
+				return ESP_OK;
+			}
+		}
+		vTaskDelay(pdMS_TO_TICKS(10));
+	}
+	return ESP_ERR_TIMEOUT;	// no edges: SQW not wired or no pull-up
+}
+
+// Sets the RTC to a 1 Hz square wave and locks on to it.
+esp_err_t watch_time_start(i2c_dev_t *dev, gpio_num_t sqw_gpio)
+{
+	if (!dev) return ESP_ERR_INVALID_ARG;
+	if (gpio != GPIO_NUM_NC) return ESP_ERR_INVALID_STATE;
+
+	esp_err_t res = ds3231_enable_squarewave(dev, DS3231_SQWAVE_1HZ);
+	if (res != ESP_OK) return res;
+
+	// INT/SQW is open drain
+	gpio_config_t io = {
+		.pin_bit_mask = 1ULL << sqw_gpio,
+		.mode = GPIO_MODE_INPUT,
+		.pull_up_en = GPIO_PULLUP_ENABLE,
+		.intr_type = GPIO_INTR_NEGEDGE,
+	};
+	res = gpio_config(&io);
+	if (res != ESP_OK) return res;
+	res = gpio_install_isr_service(0);
+	if (res != ESP_OK && res != ESP_ERR_INVALID_STATE) return res;	// already installed is fine
+
+	portENTER_CRITICAL(&lock);
+	state.edges = 0;
+	state.period = PERIOD_ONE;
+	state.base_epoch = 0;
+	portEXIT_CRITICAL(&lock);
+	res = gpio_isr_handler_add(sqw_gpio, sqw_isr, NULL);
+	if (res != ESP_OK) return res;
+	gpio = sqw_gpio;
+
+	res = lock_on(dev);
+	if (res != ESP_OK) {
+		watch_time_stop();
+		return res;
+	}
+	ESP_LOGI(TAG, "Locked to the RTC square wave on GPIO%d", sqw_gpio);
+	return ESP_OK;
+}
+
+// Setting the RTC restarts its countdown chain, so the edges move and the
+// old labels are wrong. Drops them and locks on again, keeping the rate.
+esp_err_t watch_time_relock(i2c_dev_t *dev)
+{
+	if (!dev) return ESP_ERR_INVALID_ARG;
+	if (gpio == GPIO_NUM_NC) return ESP_OK;
+
+	portENTER_CRITICAL(&lock);
+	state.edges = 0;
+	state.base_epoch = 0;
+	portEXIT_CRITICAL(&lock);
+	esp_err_t res = lock_on(dev);
+	if (res != ESP_OK) watch_time_stop();
+	return res;
+}
+
+void watch_time_stop(void)
+{
+	if (gpio == GPIO_NUM_NC) return;
+	gpio_isr_handler_remove(gpio);
+	gpio = GPIO_NUM_NC;
+	portENTER_CRITICAL(&lock);
+	state.base_epoch = 0;
+	portEXIT_CRITICAL(&lock);
+}
+
+bool watch_time_locked(void)
+{
+	return watch_time_now_us() >= 0;
+}
+
+// The last labelled edge plus the time since, scaled from esp_timer to RTC
+// time. -1 if not locked or the square wave stopped for two periods.
+int64_t watch_time_now_us(void)
+{
+	int64_t t = esp_timer_get_time();
+
+	portENTER_CRITICAL(&lock);
+	time_t second = state.base_epoch + (state.edges - state.base_edges);
+	bool locked = state.base_epoch != 0;
+	int64_t since = t - state.edge_us;
+	int64_t period = state.period;
+	portEXIT_CRITICAL(&lock);
+
+	if (!locked || since > 2 * (period >> 16)) return -1;
+	return (int64_t)second * 1000000 + since * 65536 * 1000000 / period;
+}
@@ -0,0 +1,26 @@
+#ifndef MAIN_WATCH_TIME_H_
+#define MAIN_WATCH_TIME_H_
+
+#include <stdbool.h>
+
+#include "ds3231.h"
+
+#define WATCH_TIME_LOCK_TIMEOUT_MS 2500	// wait for the first SQW edge
+#define WATCH_TIME_MAX_PPM 500			// larger period errors are taken as glitches
+#define WATCH_TIME_RATE_SHIFT 4			// rate filter weight of a new period, 1/2^n
+#define WATCH_TIME_MAX_GAP 4			// periods without an edge after which the lock is dropped
+
+// Sub-second time between RTC reads. The DS3231 drives a 1 Hz square wave
+// into 'sqw_gpio', whose falling edges mark its second boundaries. The edge
+// ISR timestamps them with esp_timer, which gives the offset and rate of
+// esp_timer against the RTC; watch_time_now_us() interpolates from the last
+// edge without touching the bus. Times are in the RTC's time base, the same
+// seconds ds3231_get_epoch() returns.
+// watch_time_relock() has to follow every write of the RTC's time, and
+// locks on again after a gap in the edges dropped the lock.
+esp_err_t watch_time_start(i2c_dev_t *dev, gpio_num_t sqw_gpio);
+esp_err_t watch_time_relock(i2c_dev_t *dev);
+void watch_time_stop(void);
+bool watch_time_locked(void);
+int64_t watch_time_now_us(void);
+#endif /* MAIN_WATCH_TIME_H_ */
@@ -0,0 +1,259 @@
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "esp_netif.h"
+#include "nvs.h"
+#include "mbedtls/pkcs5.h"
+#include "lwip/dhcp.h"
+#include "protocol_examples_common.h"
+
+#include "wifi_fast.h"
+
+#define TAG "WIFI_FAST"
+#define CACHE_KEY "ap"
+#define CONNECTED_BIT BIT0
+#define FAILED_BIT BIT1
+
+typedef struct {
+	char ssid[33];			// network the entry is for
+	uint8_t bssid[6];
+	uint8_t channel;
+	char psk[65];			// PMK in hex, which the driver takes in place of the passphrase
+	esp_netif_ip_info_t ip;
+	esp_ip4_addr_t dns;
+	int64_t leased;			// system time the address came from DHCP
+	uint32_t reuse_sec;		// how long it may be reused, 0 if not at all
+	bool valid;
+} wifi_fast_cache_t;
+
+// NVS only has to be read after a power-on
+RTC_DATA_ATTR static wifi_fast_cache_t cache;
+RTC_DATA_ATTR static wifi_fast_stats_t stats;
+
+// The connection that is up
+static struct {
+	bool cached;
+	esp_netif_t *netif;
+	EventGroupHandle_t events;
+	esp_event_handler_instance_t wifi_handler;
+	int64_t radio_on;
+} link;
+
+static bool cache_usable(void)
+{
+	if (!cache.valid || strcmp(cache.ssid, CONFIG_EXAMPLE_WIFI_SSID))
+	{
+		nvs_handle_t nvs;
+		if (nvs_open(WIFI_FAST_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) return false;
+		size_t size = sizeof(cache);
+		esp_err_t res = nvs_get_blob(nvs, CACHE_KEY, &cache, &size);
+		nvs_close(nvs);
+		if (res != ESP_OK || size != sizeof(cache)) cache.valid = false;
+		if (!cache.valid || strcmp(cache.ssid, CONFIG_EXAMPLE_WIFI_SSID)) return false;
+	}
+
+	// a lease handed out before the clock was set shows up as negative
+	int64_t age = time(NULL) - cache.leased;
+	return age >= 0 && age < cache.reuse_sec;
+}
+
+static void save_cache(void)
+{
+	nvs_handle_t nvs;
+	esp_err_t res = nvs_open(WIFI_FAST_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+	if (res != ESP_OK) return;
+	res = nvs_set_blob(nvs, CACHE_KEY, &cache, sizeof(cache));
+	if (res == ESP_OK) res = nvs_commit(nvs);
+	nvs_close(nvs);
+	if (res != ESP_OK) ESP_LOGW(TAG, "Could not store the AP cache: %s", esp_err_to_name(res));
+}
+
+void wifi_fast_invalidate(void)
+{
+	if (!cache.valid) return;
+	cache.valid = false;
+	save_cache();
+}
+
+// WPA2-PSK derives the PMK with 4096 rounds of PBKDF2, which costs the
+// driver a noticeable part of every connect; done once here it is reused.
+static void derive_psk(void)
+{
+	const char *pass = CONFIG_EXAMPLE_WIFI_PASSWORD;
+	const char *ssid = CONFIG_EXAMPLE_WIFI_SSID;
+	if (!pass[0])
+	{
+		cache.psk[0] = '\0';
+		return;
+	}
+
+	uint8_t pmk[32];
+	if (mbedtls_pkcs5_pbkdf2_hmac_ext(MBEDTLS_MD_SHA1, (const unsigned char *)pass, strlen(pass),
+		(const unsigned char *)ssid, strlen(ssid), 4096, sizeof(pmk), pmk) != 0)
+	{
+		strlcpy(cache.psk, pass, sizeof(cache.psk));
+		return;
+	}
+	for (size_t i = 0; i < sizeof(pmk); i++) sprintf(&cache.psk[i * 2], "%02x", pmk[i]);
+}
+
+static void on_wifi_event(void *arg, esp_event_base_t base, int32_t id, void *data)
+{
+	switch (id)
+	{
+	case WIFI_EVENT_STA_START:
+		esp_wifi_connect();
+		break;
+	case WIFI_EVENT_STA_CONNECTED:
+		xEventGroupSetBits(link.events, CONNECTED_BIT);
+		break;
+	case WIFI_EVENT_STA_DISCONNECTED:
+		xEventGroupSetBits(link.events, FAILED_BIT);
+		break;
+	}
+}
+
+static void teardown_cached(void)
+{
+	esp_wifi_stop();
+	stats.radio_us = esp_timer_get_time() - link.radio_on;
+	esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, link.wifi_handler);
+	esp_wifi_deinit();
+	esp_netif_destroy_default_wifi(link.netif);
+	vEventGroupDelete(link.events);
+	link.netif = NULL;
+}
+
+// With the address set statically the link is usable once associated, so
+// there is no DHCP to wait for.
+static esp_err_t connect_cached(void)
+{
+	link.events = xEventGroupCreate();
+	if (!link.events) return ESP_ERR_NO_MEM;
+	link.netif = esp_netif_create_default_wifi_sta();
+
+	wifi_init_config_t init = WIFI_INIT_CONFIG_DEFAULT();
+	esp_err_t res = esp_wifi_init(&init);
+	if (res != ESP_OK) {
+		esp_netif_destroy_default_wifi(link.netif);
+		vEventGroupDelete(link.events);
+		return res;
+	}
+	esp_wifi_set_storage(WIFI_STORAGE_RAM);
+	esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, on_wifi_event, NULL, &link.wifi_handler);
+
+	esp_netif_dhcpc_stop(link.netif);
+	esp_netif_set_ip_info(link.netif, &cache.ip);
+	esp_netif_dns_info_t dns = { .ip = { .type = ESP_IPADDR_TYPE_V4, .u_addr.ip4 = cache.dns } };
+	esp_netif_set_dns_info(link.netif, ESP_NETIF_DNS_MAIN, &dns);
+
+	wifi_config_t config = {
+		.sta = {
+			.scan_method = WIFI_FAST_SCAN,
+			.bssid_set = true,
+			.channel = cache.channel,
+		},
+	};
+	strlcpy((char *)config.sta.ssid, cache.ssid, sizeof(config.sta.ssid));
+	strlcpy((char *)config.sta.password, cache.psk, sizeof(config.sta.password));
+	memcpy(config.sta.bssid, cache.bssid, sizeof(config.sta.bssid));
+	esp_wifi_set_mode(WIFI_MODE_STA);
+	esp_wifi_set_config(WIFI_IF_STA, &config);
+
+	link.radio_on = esp_timer_get_time();
+	res = esp_wifi_start();
+	EventBits_t bits = res == ESP_OK ? xEventGroupWaitBits(link.events, CONNECTED_BIT | FAILED_BIT,
+		pdFALSE, pdFALSE, pdMS_TO_TICKS(WIFI_FAST_TIMEOUT_MS)) : 0;
+	if (!(bits & CONNECTED_BIT)) {
+		teardown_cached();
+		return res != ESP_OK ? res : bits & FAILED_BIT ? ESP_FAIL : ESP_ERR_TIMEOUT;
+	}
+	return ESP_OK;
+}
+
+// Half the lease of the address DHCP gave, the T1 at which the client would
+// renew it. 0 if the lease is not known.
+static uint32_t reuse_time(esp_netif_t *netif)
+{
+	struct netif *lwip = esp_netif_get_netif_impl(netif);
+	struct dhcp *dhcp = lwip ? netif_dhcp_data(lwip) : NULL;
+	if (!dhcp) return 0;
+	uint32_t half = dhcp->offered_t0_lease / 2;
+	return half < WIFI_FAST_REUSE_MAX_SEC ? half : WIFI_FAST_REUSE_MAX_SEC;
+}
+
+// example_connect() scans all channels and runs DHCP; what it found fills
+// the cache for the next time.
+static esp_err_t connect_full(void)
+{
+	link.radio_on = esp_timer_get_time();
+	esp_err_t res = example_connect();
+	if (res != ESP_OK) return res;
+
+	wifi_ap_record_t ap;
+	esp_netif_dns_info_t dns;
+	esp_netif_t *netif = get_example_netif();
+	if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK
+		|| esp_netif_get_ip_info(netif, &cache.ip) != ESP_OK
+		|| esp_netif_get_dns_info(netif, ESP_NETIF_DNS_MAIN, &dns) != ESP_OK) return ESP_OK;
+
+	if (strcmp(cache.ssid, CONFIG_EXAMPLE_WIFI_SSID) || !cache.psk[0]) {
+		strlcpy(cache.ssid, CONFIG_EXAMPLE_WIFI_SSID, sizeof(cache.ssid));
+		derive_psk();
+	}
+	memcpy(cache.bssid, ap.bssid, sizeof(cache.bssid));
+	cache.channel = ap.primary;
+	cache.dns = dns.ip.u_addr.ip4;
+	cache.leased = time(NULL);
+	cache.reuse_sec = reuse_time(netif);
+	cache.valid = true;
+	save_cache();
+	return ESP_OK;
+}
+
+esp_err_t wifi_fast_connect(void)
+{
+	int64_t start = esp_timer_get_time();
+	esp_err_t res = ESP_FAIL;
+	if (cache_usable())
+	{
+		res = connect_cached();
+		if (res != ESP_OK) {
+			ESP_LOGW(TAG, "Directed connect failed (%s), scanning.", esp_err_to_name(res));
+			cache.psk[0] = '\0';	// the passphrase may have changed too
+			wifi_fast_invalidate();
+		}
+	}
+	link.cached = res == ESP_OK;
+	if (!link.cached) res = connect_full();
+	if (res != ESP_OK) return res;
+
+	stats.cached = link.cached;
+	stats.connect_us = esp_timer_get_time() - start;
+	return ESP_OK;
+}
+
+esp_err_t wifi_fast_disconnect(void)
+{
+	if (link.cached)
+	{
+		esp_wifi_disconnect();
+		teardown_cached();
+		link.cached = false;
+		return ESP_OK;
+	}
+	esp_err_t res = example_disconnect();
+	stats.radio_us = esp_timer_get_time() - link.radio_on;
+	return res;
+}
+
+void wifi_fast_get_stats(wifi_fast_stats_t *out)
+{
+	*out = stats;
+}
@@ -0,0 +1,31 @@
+#ifndef MAIN_WIFI_FAST_H_
+#define MAIN_WIFI_FAST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+#define WIFI_FAST_TIMEOUT_MS 3000		// directed connect, before falling back to a full one
+#define WIFI_FAST_REUSE_MAX_SEC (12*60*60)	// longest a DHCP address is reused, whatever its lease
+#define WIFI_FAST_NVS_NAMESPACE "wififast"
+
+typedef struct {
+	bool cached;		// the last connect was a directed one
+	int64_t connect_us;	// its start to having an address
+	int64_t radio_us;	// Wi-Fi on time of the last completed connection
+} wifi_fast_stats_t;
+
+// Station connect for short time-sync wakes. A full connect goes through
+// example_connect() (scan, association, DHCP) and caches the AP's BSSID and
+// channel, the PMK and the address in RTC memory and NVS. Later connects
+// associate straight to that BSSID on that channel with the PMK and take the
+// address back without DHCP, falling back to a full connect if that fails.
+// An address is only reused for the first half of the lease the DHCP server
+// gave it, when the client would renew it anyway.
+// wifi_fast_invalidate() drops the cache when the connection did not work.
+esp_err_t wifi_fast_connect(void);
+esp_err_t wifi_fast_disconnect(void);
+void wifi_fast_invalidate(void);
+void wifi_fast_get_stats(wifi_fast_stats_t *stats);
+#endif /* MAIN_WIFI_FAST_H_ */
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+# Generates main/tz_zones.c from the POSIX TZ string at the end of each zone's
+# TZif file (RFC 8536, version 2 and later), which holds the rules in force
+# after the file's last transition.
+#
+#   tools/gen_tz_zones.py [zoneinfo dir] > main/tz_zones.c
+#
+# Only "Mm.w.d[/time]" rules are supported, which is what every zone below
+# uses. A zone whose footer does not parse stops the generator.
+
+import os
+import re
+import sys
+
+ZONES = [
+	"UTC",
+	"Europe/London",
+	"Europe/Lisbon",
+	"Europe/Amsterdam",
+	"Europe/Berlin",
+	"Europe/Brussels",
+	"Europe/Madrid",
+	"Europe/Paris",
+	"Europe/Rome",
+	"Europe/Stockholm",
+	"Europe/Warsaw",
+	"Europe/Athens",
+	"Europe/Helsinki",
+	"Europe/Kyiv",
+	"Europe/Istanbul",
+	"Europe/Moscow",
+	"Asia/Dubai",
+	"Asia/Kolkata",
+	"Asia/Shanghai",
+	"Asia/Singapore",
+	"Asia/Tokyo",
+	"Australia/Brisbane",
+	"Australia/Adelaide",
+	"Australia/Sydney",
+	"Pacific/Auckland",
+	"America/Sao_Paulo",
+	"America/Halifax",
+	"America/New_York",
+	"America/Chicago",
+	"America/Denver",
+	"America/Phoenix",
+	"America/Los_Angeles",
+	"America/Anchorage",
+	"Pacific/Honolulu",
+]
+
+NAME = r"(?:[A-Za-z]{3,}|<[+\-0-9A-Za-z]+>)"
+OFFSET = r"[+-]?\d{1,3}(?::\d{2}){0,2}"
+RULE = r"M(\d{1,2})\.(\d)\.(\d)(?:/(" + OFFSET + r"))?"
+POSIX = re.compile("^" + NAME + "(" + OFFSET + ")(?:" + NAME + "(" + OFFSET + ")?," + RULE + "," + RULE + ")?$")
+
+
+def footer(path):
+	with open(path, "rb") as f:
+		data = f.read()
+	if data[:4] != b"TZif" or data[4:5] < b"2":
+		sys.exit(path + ": not a TZif file of version 2 or later")
+	return data[data.rindex(b"\n", 0, len(data) - 1) + 1:-1].decode("ascii")
+
+
+def seconds(text):
+	sign = -1 if text.startswith("-") else 1
+	parts = [int(p) for p in text.lstrip("+-").split(":")] + [0, 0]
+	return sign * (parts[0] * 3600 + parts[1] * 60 + parts[2])
+
+
+def hours(s):
+	# 19800 -> "5 * H + 1800", in the form the table was written in
+	h, rest = int(s / 3600), abs(s) % 3600
+	text = "%d * H" % h if h else "0"
+	if rest:
+		text += (" - %d" if s < 0 else " + %d") % rest
+	return text
+
+
+def rule(m):
+	month, week, wday, time = m
+	return "{ %s, %s, %s, %s }" % (month, week, wday, hours(seconds(time) if time else 2 * 3600))
+
+
+def zone(name, tz):
+	m = POSIX.match(tz)
+	if not m:
+		sys.exit(name + ": unsupported TZ string " + tz)
+	std = -seconds(m.group(1))	# POSIX offsets count west of UTC
+	if not m.group(3):
+		return "\t{ \"%s\", FIXED(%s) },\t// %s" % (name, hours(std), tz)
+	dst = -seconds(m.group(2)) if m.group(2) else std + 3600
+	return ("\t{ \"%s\", .std_offset = %s, .dst_offset = %s,\t// %s\n"
+		"\t\t.dst_start = %s, .dst_end = %s },") % (
+		name, hours(std), hours(dst), tz, rule(m.group(3, 4, 5, 6)), rule(m.group(7, 8, 9, 10)))
+
+
+def main():
+	root = sys.argv[1] if len(sys.argv) > 1 else "/usr/share/zoneinfo"
+	version = "unknown"
+	try:
+		with open(os.path.join(root, "tzdata.zi")) as f:
+			version = f.readline().split()[-1]
+	except OSError:
+		pass
+
+	print("#include \"tz.h\"")
+	print()
+	print("// Generated by tools/gen_tz_zones.py from tzdata %s, do not edit." % version)
+	print("// Current rules of tz database zones, from the POSIX TZ string at the end of")
+	print("// each zone's TZif file. Past rule changes are not kept: the watch only")
+	print("// converts times near now. Zones that share rules are listed once per name")
+	print("// so tz_find() can take any of them.")
+	print()
+	print("#define H 3600")
+	print("#define FIXED(off)\t.std_offset = (off), .dst_offset = (off)")
+	print()
+	print("const tz_zone_t tz_zones[] = {")
+	for name in ZONES:
+		print(zone(name, footer(os.path.join(root, name))))
+	print("};")
+	print("const size_t tz_zone_count = sizeof(tz_zones) / sizeof(tz_zones[0]);")
+
+
+if __name__ == "__main__":
+	main()